@@ -68,20 +68,20 @@ struct Containers {
     }
 };
 
-template<typename Container, typename Iterator>
-bool isEnd( Iterator const& it, Container const& container ) {
-    return it == container.end();
+template<typename Container, typename T>
+bool contains( Container const& container, T const& item ) {
+    return container.find( item ) != container.end();
 }
-template<typename T, typename Iterator>
-bool isEnd( Iterator const& it, hamt::hash_trie<T> const& ) {
-    return !it.leaf();
+template<typename T, typename U>
+bool contains( hamt::hash_trie<T> const& container, U const& item ) {
+    return container.contains( item );
 }
 
 template<typename Src, typename Dest>
 int testFind( Src const& src, Dest& dest ) {
     int count = 0;
     for (auto const &item : src)
-        count += isEnd(dest.find(item), dest) ? 0 : 1;
+        count += contains(dest, item) ? 1 : 0;
 
     return count;
 }
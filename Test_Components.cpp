@@ -2,6 +2,24 @@
 
 #include "catch.hpp"
 
+#include <stdexcept>
+#include <string>
+
+// Counts the instances alive, and throws if a negative one is copied
+struct counted {
+    static inline int live = 0;
+    int value;
+
+    explicit counted( int value ) : value( value ) { ++live; }
+    counted( counted const& other ) : value( other.value ) {
+        if( value < 0 )
+            throw std::runtime_error( "copy failed" );
+        ++live;
+    }
+    ~counted() { --live; }
+    auto operator==( counted const& other ) const -> bool { return value == other.value; }
+};
+
 TEST_CASE( "chunked hash" ) {
     using namespace hamt::detail;
 
@@ -30,29 +48,212 @@ TEST_CASE( "chunked hash" ) {
 TEST_CASE("explicit nodes") {
     using namespace hamt;
 
-    auto leaf = leaf_node<int>::create(42, std::hash<int>()(42));
-    auto v = branch_node<int>::create_single(sparse_index(1), leaf.get());
+    auto leaf = leaf_node<std::string>::create("42", std::hash<std::string>()("42"));
+    auto v = branch_node<std::string>::create_single(sparse_index(1), leaf.get());
     leaf.release();
     CHECK( v->size() == 1 );
 
-    auto n1 = branch_node<int>::create_single(sparse_index(5), v.release());
+    auto n1 = branch_node<std::string>::create_single(sparse_index(5), v.release());
     CHECK( n1->size() == 1 );
 
-    auto leaf7 = leaf_node<int>::create(7, std::hash<int>()(7));
-    auto n2 = n1->branch_node<int>::with_inserted(sparse_index(3), leaf7.get());
+    auto leaf7 = leaf_node<std::string>::create("7", std::hash<std::string>()("7"));
+    auto n2 = n1->branch_node<std::string>::with_inserted(sparse_index(3), leaf7.get());
     leaf7.release();
 
     CHECK( n2->size() == 2 );
 
     auto result3 = n2->get_at(sparse_index(3));
     CHECK( result3->m_type == node_type::leaf );
-    CHECK(static_cast<leaf_node<int> const *>( result3 )->get_at(0) == 7 );
+    CHECK(static_cast<leaf_node<std::string> const *>( result3 )->get_at(0) == "7" );
 
     auto result5 = n2->get_at(sparse_index(5));
     CHECK( result5->m_type == node_type::branch );
 
-    auto b = static_cast<branch_node<int> const*>( result5 );
+    auto b = static_cast<branch_node<std::string> const*>( result5 );
     auto result1 = b->get_at(sparse_index(1));
     CHECK( result1->m_type == node_type::leaf );
-    CHECK(static_cast<leaf_node<int> const *>( result1 )->get_at(0) == 42 );
-}
\ No newline at end of file
+    CHECK(static_cast<leaf_node<std::string> const *>( result1 )->get_at(0) == "42" );
+}
+TEST_CASE( "path compression" ) {
+    using namespace hamt;
+
+    // (the lowest four bits of an int go into the final hash chunk, so the rest are shifted past them)
+    int a = 0b01000'00010'00001 << 4;
+    int b = 0b00100'00010'00001 << 4; // shares first two chunks with a
+    int c = 0b00000'00011'00001 << 4; // shares only the first chunk
+
+    hash_trie<int> h;
+    h.insert( a );
+    h.insert( b );
+
+    // a and b diverge at the third chunk, so the second chunk is a compressed prefix
+    // of a single branch, rather than a branch of its own
+    auto p1 = h.find( a );
+    REQUIRE( p1.kind() == child_kind::inline_value );
+    CHECK( p1.size() == 1 );
+    CHECK( p1.last_branch()->skip() == 1 );
+    CHECK( p1.last_branch()->prefix() == 0b00010 );
+
+    SECTION( "split on insert" ) {
+        h.insert( c );
+
+        auto p2 = h.find( a );
+        REQUIRE( p2.kind() == child_kind::inline_value );
+        CHECK( p2.size() == 2 );
+        CHECK( p2.last_branch()->skip() == 0 );
+        CHECK( h.find( c ).kind() == child_kind::inline_value );
+
+        SECTION( "re-merge on erase" ) {
+            CHECK( h.erase( c ) );
+
+            auto p3 = h.find( a );
+            REQUIRE( p3.kind() == child_kind::inline_value );
+            CHECK( p3.size() == 1 );
+            CHECK( p3.last_branch()->skip() == 1 );
+            CHECK( p3.last_branch()->prefix() == 0b00010 );
+        }
+    }
+    SECTION( "mismatched prefix is not found" ) {
+        auto p = h.find( 0b01000'00011'00001 << 4 );
+        CHECK( p.prefix_mismatch() );
+        CHECK( p.kind() == child_kind::none );
+    }
+}
+
+TEST_CASE( "level compression" ) {
+    using namespace hamt;
+
+    // (shifted past the final chunk, so the first two chunks of these are all used)
+    const int num = 4096;
+    hash_trie<int> h;
+    for( int i = 0; i < num; ++i )
+        h.insert( i << 4 );
+
+    REQUIRE( h.find( 42 << 4 ).size() == 2 );
+    CHECK_FALSE( h.data().m_root->is_wide() );
+
+    hash_trie<int> uncompacted = h;
+    h.compact();
+
+    REQUIRE( h.data().m_root->is_wide() );
+    CHECK( h.data().m_root->size() == 1024 );
+    CHECK( h.find( 42 << 4 ).size() == 1 );
+    CHECK( h.contains( 42 << 4 ) );
+    CHECK( h.size() == num );
+    CHECK_FALSE( uncompacted.data().m_root->is_wide() );
+
+    SECTION( "falls back to regular branches as it thins out" ) {
+        for( int i = 0; i < num; ++i ) {
+            if( i % 1024 < 600 )
+                h.erase( i << 4 );
+        }
+        CHECK_FALSE( h.data().m_root->is_wide() );
+        CHECK( h.find( 1000 << 4 ).size() == 2 );
+        CHECK( h.contains( 1000 << 4 ) );
+    }
+}
+
+TEST_CASE( "fingerprints" ) {
+    using namespace hamt;
+
+    auto leaf1 = leaf_node<std::string>::create("1", std::hash<std::string>()("1"));
+    auto leaf2 = leaf_node<std::string>::create("2", std::hash<std::string>()("2"));
+    auto pair = branch_node<std::string>::create_pair(sparse_index(1), leaf1.get(), sparse_index(2), leaf2.get());
+    leaf1.release();
+    leaf2.release();
+
+    CHECK( pair->fingerprint_at(compact_index(0)) == detail::fingerprint(std::hash<std::string>()("1")) );
+    CHECK( pair->fingerprint_at(compact_index(1)) == detail::fingerprint(std::hash<std::string>()("2")) );
+
+    auto parent = branch_node<std::string>::create_single(sparse_index(7), pair.get());
+    pair.release();
+    CHECK( parent->fingerprint_at(compact_index(0)) == 0 );
+
+    // Fingerprints are shared along with their leaves
+    auto leaf3 = leaf_node<std::string>::create("3", std::hash<std::string>()("3"));
+    auto copy = static_cast<branch_node<std::string> const*>( parent->get_at(compact_index(0)) )->with_inserted(sparse_index(3), leaf3.get());
+    leaf3.release();
+    CHECK( copy->fingerprint_at(compact_index(0)) == detail::fingerprint(std::hash<std::string>()("1")) );
+    CHECK( copy->fingerprint_at(compact_index(1)) == detail::fingerprint(std::hash<std::string>()("2")) );
+    CHECK( copy->fingerprint_at(compact_index(2)) == detail::fingerprint(std::hash<std::string>()("3")) );
+}
+
+TEST_CASE( "inline integer values" ) {
+    using namespace hamt;
+
+    hash_trie<int> h;
+    h.insert( 42 );
+    CHECK( h.find( 42 ).kind() == child_kind::inline_value );
+    CHECK( h.contains( 42 ) );
+    CHECK_FALSE( h.contains( 43 ) );
+
+    SECTION( "values that only differ in the final chunk share a bitmap" ) {
+        for( int i = 32; i < 48; ++i )
+            h.insert( i );
+        CHECK( h.size() == 16 );
+
+        auto p = h.find( 42 );
+        REQUIRE( p.kind() == child_kind::bitmap );
+        CHECK( p.bitmap()->size() == 16 );
+        CHECK( p.size() == 0 );
+
+        for( int i = 32; i < 47; ++i )
+            CHECK( h.erase( i ) );
+        CHECK( h.find( 47 ).kind() == child_kind::inline_value );
+        CHECK_FALSE( h.contains( 42 ) );
+        CHECK( h.contains( 47 ) );
+    }
+    SECTION( "negative values" ) {
+        h.insert( -1 );
+        h.insert( -42 );
+        CHECK( h.contains( -1 ) );
+        CHECK( h.contains( -42 ) );
+        CHECK_FALSE( h.contains( -2 ) );
+
+        int sum = 0;
+        for( auto it = h.begin(); it != h.end(); ++it )
+            sum += *it;
+        CHECK( sum == -1 );
+    }
+}
+
+TEST_CASE( "string leaves" ) {
+    using namespace hamt;
+
+    // Values are only appended to a leaf when their hashes collide, so use an arbitrary hash
+    auto leaf = leaf_node<std::string>::create( "short", 42 );
+    auto longer = std::string( 100, 'x' );
+    auto leaf2 = leaf->with_appended_value( longer );
+    auto leaf3 = leaf2->with_appended_value( "" );
+
+    REQUIRE( leaf3->size() == 3 );
+    CHECK( leaf3->get_at( 0 ) == "short" );
+    CHECK( leaf3->get_at( 1 ) == longer );
+    CHECK( leaf3->get_at( 2 ).empty() );
+    CHECK( leaf3->find( longer ) );
+    CHECK( leaf3->find( "" ) );
+    CHECK_FALSE( leaf3->find( "shor" ) );
+
+    auto leaf4 = leaf3->without_value( longer );
+    REQUIRE( leaf4->size() == 2 );
+    CHECK( leaf4->get_at( 0 ) == "short" );
+    CHECK( leaf4->get_at( 1 ).empty() );
+    CHECK_FALSE( leaf4->find( longer ) );
+}
+
+TEST_CASE( "leaf values that throw on copy" ) {
+    using namespace hamt;
+
+    {
+        auto leaf = leaf_node<counted>::create( counted( 1 ), 42 );
+        auto leaf2 = leaf->with_appended_value( counted( 2 ) );
+        REQUIRE( counted::live == 3 );
+
+        // Only the values copied before the one that threw are destroyed
+        CHECK_THROWS_AS( leaf2->with_appended_value( counted( -3 ) ), std::runtime_error );
+        CHECK( counted::live == 3 );
+        CHECK_THROWS_AS( leaf_node<counted>::create( counted( -1 ), 42 ), std::runtime_error );
+        CHECK( counted::live == 3 );
+    }
+    CHECK( counted::live == 0 );
+}
@@ -2,9 +2,39 @@
 
 #include "catch.hpp"
 
-TEST_CASE( "is_lock_free", "[!mayfail]" ) {
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
-    // Depending on th platform this may or may not be a lock-free implementation
+// A value whose copy throws if it is negative
+struct fragile {
+    int value;
+
+    explicit fragile( int value ) : value( value ) {}
+    fragile( fragile const& other ) : value( other.value ) {
+        if( value < 0 )
+            throw std::runtime_error( "copy failed" );
+    }
+    auto operator==( fragile const& other ) const -> bool { return value == other.value; }
+};
+
+namespace std {
+    template<>
+    struct hash<fragile> {
+        auto operator()( fragile const& f ) const -> size_t { return std::hash<int>()( f.value ); }
+    };
+}
+
+TEST_CASE( "is_lock_free" ) {
+
+    // Only the root pointer is atomic, so this is lock-free on any platform
     REQUIRE( hamt::shared_hash_trie<int>().is_lock_free() );
 }
 
@@ -90,4 +120,1193 @@ TEST_CASE( "transaction task" ) {
 
     hash_trie<int> h2 = sh.get();
     REQUIRE( h2.size() == 3 );
-}
\ No newline at end of file
+}
+
+TEST_CASE( "recorded transactions" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+    sh.update_with( []( hash_trie<int>& h ) { h.insert( 1 ); } );
+
+    auto trans1 = sh.start_transaction();
+    auto trans2 = sh.start_transaction();
+
+    SECTION( "blind writes are replayed onto a newer base" ) {
+        trans1.insert( 2 );
+        trans2.insert( 3 );
+        trans2.erase( 1 );
+        REQUIRE( trans1.try_commit() );
+        REQUIRE( trans2.try_commit() );
+
+        auto h = sh.get();
+        REQUIRE( h.size() == 2 );
+        REQUIRE( h.contains( 2 ) );
+        REQUIRE( h.contains( 3 ) );
+        REQUIRE_FALSE( h.contains( 1 ) );
+    }
+    SECTION( "reads of values that were not changed don't conflict" ) {
+        trans1.insert( 2 );
+        if( trans2.contains( 1 ) )
+            trans2.insert( 10 );
+        REQUIRE( trans1.try_commit() );
+        REQUIRE( trans2.try_commit() );
+        REQUIRE( sh.get().size() == 3 );
+    }
+    SECTION( "reads of values that were changed conflict" ) {
+        trans1.erase( 1 );
+        if( trans2.contains( 1 ) )
+            trans2.insert( 10 );
+        REQUIRE( trans1.try_commit() );
+        REQUIRE_FALSE( trans2.try_commit() );
+
+        // The transaction has been rebased, with nothing recorded
+        REQUIRE( trans2.get().empty() );
+        REQUIRE( trans2.try_commit() );
+        REQUIRE( sh.get().empty() );
+    }
+    SECTION( "reading back your own writes doesn't conflict" ) {
+        trans1.erase( 1 );
+        trans2.insert( 1 );
+        REQUIRE( trans2.contains( 1 ) );
+        REQUIRE( trans1.try_commit() );
+        REQUIRE( trans2.try_commit() );
+        REQUIRE( sh.get().contains( 1 ) );
+    }
+    SECTION( "reading the size conflicts with any change to it" ) {
+        trans1.insert( 2 );
+        trans2.insert( static_cast<int>( trans2.size() ) + 100 );
+        REQUIRE( trans1.try_commit() );
+        REQUIRE_FALSE( trans2.try_commit() );
+    }
+}
+
+TEST_CASE( "recorded transaction task" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+    int runs = 0;
+
+    SECTION( "is not re-run for a disjoint commit" ) {
+        sh.update_with( [&]( hash_trie_transaction<int>& t ) {
+            ++runs;
+            t.insert( 1 );
+            if( runs == 1 )
+                sh.update_with( []( hash_trie<int>& h ) { h.insert( 2 ); } );
+        } );
+        REQUIRE( runs == 1 );
+        REQUIRE( sh.get().size() == 2 );
+    }
+    SECTION( "is re-run when something it read changed" ) {
+        sh.update_with( [&]( hash_trie_transaction<int>& t ) {
+            ++runs;
+            if( !t.contains( 2 ) )
+                t.insert( 1 );
+            if( runs == 1 )
+                sh.update_with( []( hash_trie<int>& h ) { h.insert( 2 ); } );
+        } );
+        REQUIRE( runs == 2 );
+        REQUIRE( sh.get().size() == 1 );
+    }
+}
+
+TEST_CASE( "update_with contention" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+
+    SECTION( "returns the task's result" ) {
+        auto outcome = sh.update_with( []( hash_trie<int>& h ) {
+            h.insert( 1 );
+            return 42;
+        } );
+        REQUIRE( outcome.result == 42 );
+        REQUIRE( outcome.attempts == 1 );
+        REQUIRE_FALSE( outcome.queued );
+    }
+    SECTION( "queues after enough failures" ) {
+        contention_policy policy;
+        policy.strategy = contention_policy::backoff::yield;
+        policy.lockAfter = 2;
+
+        int runs = 0;
+        auto outcome = sh.update_with( [&]( hash_trie<int>& h ) {
+            h.insert( 1 );
+            if( ++runs <= 2 )
+                sh.update_with( [&]( hash_trie<int>& other ) { other.insert( 100 + runs ); } );
+        }, policy );
+        REQUIRE( outcome.attempts == 3 );
+        REQUIRE( outcome.queued );
+        REQUIRE( sh.get().size() == 3 );
+    }
+    SECTION( "queued writers are served before first attempts" ) {
+        contention_policy policy;
+        policy.lockAfter = 0; // (queue straight away)
+
+        std::atomic<bool> slowStarted { false };
+        std::atomic<bool> letSlowFinish { false };
+        std::atomic<bool> fastFinished { false };
+        update_result<void> slowOutcome { 0, false };
+        update_result<void> fastOutcome { 0, false };
+        std::thread slow( [&] {
+            slowOutcome = sh.update_with( [&]( hash_trie<int>& h ) {
+                h.insert( 1 );
+                slowStarted = true;
+                while( !letSlowFinish )
+                    std::this_thread::yield();
+            }, policy );
+        } );
+        while( !slowStarted )
+            std::this_thread::yield();
+
+        std::thread fast( [&] {
+            fastOutcome = sh.update_with( []( hash_trie<int>& h ) { h.insert( 2 ); } );
+            fastFinished = true;
+        } );
+        std::this_thread::sleep_for( std::chrono::milliseconds( 20 ) );
+        CHECK_FALSE( fastFinished ); // (it is waiting for the queued writer)
+        letSlowFinish = true;
+        slow.join();
+        fast.join();
+
+        // So the queued writer's first commit went through, and the other's didn't need to queue
+        REQUIRE( slowOutcome.queued );
+        REQUIRE( slowOutcome.attempts == 1 );
+        REQUIRE_FALSE( fastOutcome.queued );
+        REQUIRE( fastOutcome.attempts == 1 );
+        REQUIRE( sh.get().size() == 2 );
+    }
+    SECTION( "a queued task can update the same trie" ) {
+        contention_policy policy;
+        policy.lockAfter = 0;
+
+        int runs = 0;
+        auto outcome = sh.update_with( [&]( hash_trie<int>& h ) {
+            h.insert( 1 );
+            if( ++runs == 1 )
+                sh.update_with( []( hash_trie<int>& other ) { other.insert( 2 ); }, policy );
+        }, policy );
+        REQUIRE( outcome.queued );
+        REQUIRE( outcome.attempts == 2 );
+        REQUIRE( sh.get().size() == 2 );
+    }
+    SECTION( "many writers" ) {
+        const int threadCount = 8;
+        const int perThread = 200;
+
+        for( auto strategy : { contention_policy::backoff::none,
+                               contention_policy::backoff::yield,
+                               contention_policy::backoff::exponential } ) {
+            contention_policy policy;
+            policy.strategy = strategy;
+            policy.lockAfter = 1;
+
+            shared_hash_trie<int> shared;
+            std::atomic<size_t> attempts { 0 };
+            std::vector<std::thread> threads;
+            for( int t = 0; t < threadCount; ++t ) {
+                threads.emplace_back( [&, t] {
+                    for( int i = 0; i < perThread; ++i ) {
+                        auto outcome = shared.update_with( [&]( hash_trie_transaction<int>& trans ) {
+                            trans.insert( t * perThread + i );
+                            return trans.size();
+                        }, policy );
+                        attempts += outcome.attempts;
+                    }
+                } );
+            }
+            for( auto& thread : threads )
+                thread.join();
+
+            REQUIRE( shared.get().size() == threadCount * perThread );
+            REQUIRE( attempts >= threadCount * perThread );
+        }
+    }
+}
+
+TEST_CASE( "concurrent snapshots" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+    std::atomic<bool> done { false };
+    std::atomic<int> badSnapshots { 0 };
+
+    // Readers take snapshots while the writers keep replacing (and releasing) the root
+    std::vector<std::thread> readers;
+    for( int i = 0; i < 3; ++i ) {
+        readers.emplace_back( [&] {
+            while( !done ) {
+                auto snapshot = sh.get();
+                size_t count = 0;
+                for( auto it = snapshot.begin(); it != snapshot.end(); ++it )
+                    ++count;
+                if( count != snapshot.size() )
+                    ++badSnapshots;
+            }
+        } );
+    }
+    std::vector<std::thread> writers;
+    for( int i = 0; i < 2; ++i ) {
+        writers.emplace_back( [&, i] {
+            for( int j = 0; j < 500; ++j ) {
+                sh.update_with( [&]( hash_trie<int>& h ) {
+                    h.insert( i*1000 + j );
+                    if( j % 3 == 0 )
+                        h.erase( i*1000 + j/2 );
+                } );
+            }
+        } );
+    }
+    for( auto& writer : writers )
+        writer.join();
+    done = true;
+    for( auto& reader : readers )
+        reader.join();
+
+    REQUIRE( badSnapshots == 0 );
+    REQUIRE( sh.get().size() == 2*(500 - 167) );
+}
+
+TEST_CASE( "read" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+    sh.update_with( []( hash_trie<int>& h ) {
+        h.insert( 1 );
+        h.insert( 2 );
+    } );
+
+    SECTION( "view" ) {
+        auto found = sh.read( []( hash_trie_view<int> view ) {
+            return view.contains( 1 ) && view.contains( 2 ) && !view.contains( 3 );
+        } );
+        REQUIRE( found );
+        REQUIRE( sh.read( []( hash_trie_view<int> view ) { return view.size(); } ) == 2 );
+    }
+    SECTION( "nested, beyond the available hazard slots" ) {
+        std::function<size_t(int)> readNested = [&]( int depth ) {
+            return sh.read( [&]( hash_trie_view<int> view ) {
+                return depth == 0 ? view.size() : view.size() + readNested( depth-1 );
+            } );
+        };
+        REQUIRE( readNested( 9 ) == 20 );
+    }
+    SECTION( "snapshot outlives the read" ) {
+        auto snapshot = sh.read( []( hash_trie_view<int> view ) { return view.snapshot(); } );
+        sh.update_with( []( hash_trie<int>& h ) { h.insert( 3 ); } );
+        REQUIRE( snapshot.size() == 2 );
+        REQUIRE( sh.get().size() == 3 );
+    }
+}
+
+TEST_CASE( "epoch reclamation" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int, epoch_reclamation> sh;
+    std::atomic<bool> done { false };
+    std::atomic<int> badReads { 0 };
+
+    std::vector<std::thread> readers;
+    for( int i = 0; i < 3; ++i ) {
+        readers.emplace_back( [&] {
+            while( !done ) {
+                sh.read( [&]( hash_trie_view<int> view ) {
+                    size_t count = 0;
+                    for( auto it = view.begin(); it != view.end(); ++it )
+                        ++count;
+                    if( count != view.size() )
+                        ++badReads;
+                } );
+                auto snapshot = sh.get();
+                if( snapshot.size() > 1000 )
+                    ++badReads;
+            }
+        } );
+    }
+    std::vector<std::thread> writers;
+    for( int i = 0; i < 2; ++i ) {
+        writers.emplace_back( [&, i] {
+            for( int j = 0; j < 500; ++j ) {
+                sh.update_with( [&]( hash_trie<int>& h ) {
+                    h.insert( i*1000 + j );
+                    if( j % 3 == 0 )
+                        h.erase( i*1000 + j/2 );
+                } );
+            }
+        } );
+    }
+    for( auto& writer : writers )
+        writer.join();
+    done = true;
+    for( auto& reader : readers )
+        reader.join();
+
+    REQUIRE( badReads == 0 );
+    REQUIRE( sh.get().size() == 2*(500 - 167) );
+    REQUIRE( epoch_reclamation::collect() );
+}
+
+TEST_CASE( "borrowed snapshot" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+    sh.update_with( []( hash_trie<int>& h ) { h.insert( 1 ); } );
+    {
+        auto snapshot = sh.borrow();
+        sh.update_with( []( hash_trie<int>& h ) { h.insert( 2 ); } );
+
+        // The borrowed root is still alive, and unchanged
+        REQUIRE( snapshot->size() == 1 );
+        REQUIRE( snapshot->contains( 1 ) );
+        REQUIRE_FALSE( snapshot->contains( 2 ) );
+    }
+    REQUIRE( sh.borrow()->size() == 2 );
+
+    // Snapshots can be let go of in any order (here, held on the heap), without one
+    // losing the protection of its root to another
+    struct held { borrowed_snapshot<int, hazard_pointer_reclamation> snapshot; };
+    auto a = std::unique_ptr<held>( new held{ sh.borrow() } );
+    sh.update_with( []( hash_trie<int>& h ) { h.insert( 3 ); } );
+    auto b = std::unique_ptr<held>( new held{ sh.borrow() } );
+    a.reset();
+    sh.update_with( []( hash_trie<int>& h ) { h.insert( 4 ); } );
+    auto c = std::unique_ptr<held>( new held{ sh.borrow() } );
+    for( int i = 5; i < 500; ++i )
+        sh.update_with( [i]( hash_trie<int>& h ) { h.insert( i ); } );
+
+    CHECK( b->snapshot->size() == 3 );
+    CHECK( b->snapshot->contains( 3 ) );
+    CHECK_FALSE( b->snapshot->contains( 4 ) );
+    CHECK( c->snapshot->size() == 4 );
+}
+
+TEST_CASE( "snapshot cache" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+    snapshot_cache<int> cache( sh );
+    REQUIRE( cache.get().empty() );
+
+    auto version = sh.version();
+    sh.update_with( []( hash_trie<int>& h ) { h.insert( 1 ); } );
+    REQUIRE( sh.version() == version+1 );
+
+    auto const& snapshot = cache.get();
+    REQUIRE( snapshot.size() == 1 );
+
+    SECTION( "is reused until the version changes" ) {
+        REQUIRE( cache.get().data().m_root == snapshot.data().m_root );
+        REQUIRE( cache.get().data().m_root == sh.data().m_root );
+
+        sh.update_with( []( hash_trie<int>& h ) { h.insert( 2 ); } );
+        REQUIRE( cache.get().size() == 2 );
+    }
+    SECTION( "no-op updates don't change the version" ) {
+        sh.update_with( []( hash_trie<int>& h ) { h.insert( 1 ); } );
+        REQUIRE( sh.version() == version+1 );
+    }
+}
+
+TEST_CASE( "version waiting" ) {
+
+    using namespace hamt;
+    using namespace std::chrono_literals;
+
+    shared_hash_trie<int> sh;
+    auto version = sh.version();
+
+    SECTION( "times out without a commit" ) {
+        REQUIRE( sh.wait_for_version_after( version, 1ms ) == version );
+    }
+    SECTION( "returns at once if already moved on" ) {
+        sh.update_with( []( hash_trie<int>& h ) { h.insert( 1 ); } );
+        REQUIRE( sh.wait_for_version_after( version ) == version + 1 );
+    }
+    SECTION( "wakes on commit" ) {
+        const int commits = 100;
+        std::atomic<int> seen { 0 };
+        std::atomic<bool> wentBackwards { false };
+        std::thread subscriber( [&] {
+            auto last = version;
+            while( last != version + commits ) {
+                auto next = sh.wait_for_version_after( last );
+                if( next <= last )
+                    wentBackwards = true;
+                last = next;
+                seen = static_cast<int>( sh.get().size() );
+            }
+        } );
+        for( int i = 0; i < commits; ++i )
+            sh.update_with( [i]( hash_trie<int>& h ) { h.insert( i ); } );
+        subscriber.join();
+
+        REQUIRE_FALSE( wentBackwards );
+        REQUIRE( seen == commits );
+    }
+}
+
+TEST_CASE( "version history" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+    for( int i = 0; i < 1000; ++i )
+        sh.update_with( [i]( hash_trie<int>& h ) { h.insert( i * 1000 ); } );
+
+    SECTION( "by version" ) {
+        version_history<int> history( sh, 8 );
+        REQUIRE( history.latest_version() == 1000 );
+        REQUIRE( history.retained_bytes() == 0 );
+
+        for( int i = 0; i < 20; ++i )
+            sh.update_with( [i]( hash_trie<int>& h ) { h.erase( i * 1000 ); } );
+
+        CHECK( history.latest_version() == 1020 );
+        CHECK( history.oldest_version() == 1013 );
+        CHECK_FALSE( history.get_at_version( 1012 ) );
+        for( uint64_t version = 1013; version <= 1020; ++version ) {
+            auto trie = history.get_at_version( version );
+            REQUIRE( trie );
+            CHECK( trie->size() == 2000 - version );
+        }
+        CHECK_FALSE( history.get_at_version( 1021 ) );
+
+        // Holding on to the old versions only keeps the nodes that have changed since
+        auto retained = history.retained_bytes();
+        CHECK( retained > 0 );
+        CHECK( retained < detail::subtree_bytes( sh.get().data().m_root ) );
+    }
+    SECTION( "by time" ) {
+        version_history<int> history( sh );
+        auto before = version_history<int>::clock::now();
+        sh.update_with( []( hash_trie<int>& h ) { h.insert( 1 ); } );
+
+        auto then = history.get_at_time( before );
+        REQUIRE( then );
+        CHECK_FALSE( then->contains( 1 ) );
+        auto now = history.get_at_time( version_history<int>::clock::now() );
+        REQUIRE( now );
+        CHECK( now->contains( 1 ) );
+        CHECK_FALSE( history.get_at_time( before - std::chrono::hours( 1 ) ) );
+    }
+    SECTION( "by age" ) {
+        {
+            version_history<int> history( sh, 8, std::chrono::hours( 1 ) );
+            sh.update_with( []( hash_trie<int>& h ) { h.insert( 1 ); } );
+            CHECK( history.oldest_version() == 1000 );
+        }
+        version_history<int> shortHistory( sh, 8, std::chrono::nanoseconds( 0 ) );
+        sh.update_with( []( hash_trie<int>& h ) { h.insert( 2 ); } );
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+        shortHistory.trim();
+        CHECK( shortHistory.oldest_version() == shortHistory.latest_version() );
+    }
+    SECTION( "concurrent commits are all recorded" ) {
+        // Each commit adds one value, so the trie at each version holds that many
+        const int writers = 4;
+        const int perWriter = 250;
+        version_history<int> history( sh, 64 );
+
+        std::atomic<bool> done { false };
+        std::atomic<int> mismatches { 0 };
+        std::thread reader( [&] {
+            while( !done ) {
+                auto version = history.latest_version();
+                auto trie = history.get_at_version( version );
+                if( trie && trie->size() != version )
+                    ++mismatches;
+            }
+        } );
+        std::vector<std::thread> threads;
+        for( int t = 0; t < writers; ++t ) {
+            threads.emplace_back( [&, t] {
+                for( int i = 0; i < perWriter; ++i )
+                    sh.update_with( [value = t * perWriter + i + 1]( hash_trie<int>& h ) { h.insert( -value ); } );
+            } );
+        }
+        for( auto& thread : threads )
+            thread.join();
+        done = true;
+        reader.join();
+
+        CHECK( mismatches == 0 );
+        REQUIRE( history.latest_version() == 2000 );
+        CHECK( history.oldest_version() == 2000 - 63 );
+        for( auto version = history.oldest_version(); version <= 2000; ++version ) {
+            auto trie = history.get_at_version( version );
+            REQUIRE( trie );
+            CHECK( trie->size() == version );
+        }
+    }
+    SECTION( "attached and detached while others commit" ) {
+        std::atomic<bool> done { false };
+        std::vector<std::thread> threads;
+        for( int t = 0; t < 2; ++t ) {
+            threads.emplace_back( [&, t] {
+                for( int i = 0; !done; ++i )
+                    sh.update_with( [value = t * 1000000 + i + 1]( hash_trie<int>& h ) { h.insert( -value ); } );
+            } );
+        }
+        int mismatches = 0;
+        for( int i = 0; i < 200; ++i ) {
+            version_history<int> history( sh, 64 );
+            auto version = history.latest_version();
+            auto trie = history.get_at_version( version ); // (unless a whole ring of commits has replaced it)
+            if( trie && trie->size() != version )
+                ++mismatches;
+        }
+        done = true;
+        for( auto& thread : threads )
+            thread.join();
+        CHECK( mismatches == 0 );
+    }
+}
+
+TEST_CASE( "change feed" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+    sh.update_with( []( hash_trie<int>& h ) { h.insert( 1 ); } );
+
+    std::set<int> added, removed;
+    auto onAdded = [&]( int value ) { added.insert( value ); };
+    auto onRemoved = [&]( int value ) { removed.insert( value ); };
+    auto toSet = []( hash_trie_view<int> view ) {
+        std::set<int> values;
+        for( auto value : view )
+            values.insert( value );
+        return values;
+    };
+
+    SECTION( "one commit at a time" ) {
+        change_feed<int> feed( sh );
+        auto subscriber = feed.subscribe();
+        REQUIRE( subscriber.version() == 1 );
+        REQUIRE( subscriber.next( onAdded, onRemoved ) == 0 );
+
+        sh.update_with( []( hash_trie<int>& h ) { h.insert( 2 ); h.insert( 3 ); } );
+        sh.update_with( []( hash_trie<int>& h ) { h.erase( 1 ); } );
+
+        REQUIRE( subscriber.next( onAdded, onRemoved ) == 1 );
+        CHECK( added == std::set<int>{ 2, 3 } );
+        CHECK( removed.empty() );
+
+        added.clear();
+        REQUIRE( subscriber.next( onAdded, onRemoved ) == 1 );
+        CHECK( added.empty() );
+        CHECK( removed == std::set<int>{ 1 } );
+
+        REQUIRE( subscriber.next( onAdded, onRemoved ) == 0 );
+        CHECK( subscriber.version() == 3 );
+        CHECK( subscriber.snapshot().size() == 2 );
+    }
+    SECTION( "a subscriber that falls behind catches up" ) {
+        change_feed<int> feed( sh, 4 );
+        auto subscriber = feed.subscribe();
+        for( int i = 2; i < 12; ++i )
+            sh.update_with( [i]( hash_trie<int>& h ) { h.insert( i ); } );
+
+        REQUIRE( subscriber.next( onAdded, onRemoved ) == 10 );
+        CHECK( added.size() == 10 );
+        CHECK( subscriber.version() == sh.version() );
+        REQUIRE( subscriber.next( onAdded, onRemoved ) == 0 );
+    }
+    SECTION( "concurrent writers and subscribers" ) {
+        const int writers = 3;
+        const int perWriter = 300;
+        change_feed<int> feed( sh, 16 );
+
+        std::atomic<bool> done { false };
+        std::atomic<int> mismatches { 0 };
+        std::vector<std::thread> subscribers;
+        for( int i = 0; i < 2; ++i ) {
+            subscribers.emplace_back( [&] {
+                auto subscriber = feed.subscribe();
+                auto replica = toSet( subscriber.snapshot() );
+                auto follow = [&] {
+                    while( subscriber.next( [&]( int value ) { replica.insert( value ); },
+                                            [&]( int value ) { replica.erase( value ); } ) > 0 ) {
+                        if( replica.size() != subscriber.snapshot().size() )
+                            ++mismatches;
+                    }
+                };
+                while( !done )
+                    follow();
+                follow();
+                if( replica != toSet( sh.get() ) )
+                    ++mismatches;
+            } );
+        }
+
+        std::vector<std::thread> threads;
+        for( int t = 0; t < writers; ++t ) {
+            threads.emplace_back( [&, t] {
+                for( int i = 0; i < perWriter; ++i ) {
+                    auto value = t * perWriter + i;
+                    sh.update_with( [value]( hash_trie<int>& h ) { h.insert( value ); } );
+                    if( i % 3 == 0 )
+                        sh.update_with( [value]( hash_trie<int>& h ) { h.erase( value ); } );
+                }
+            } );
+        }
+        for( auto& thread : threads )
+            thread.join();
+        done = true;
+        for( auto& thread : subscribers )
+            thread.join();
+
+        REQUIRE( mismatches == 0 );
+    }
+}
+
+TEST_CASE( "shared_trie_group" ) {
+
+    using namespace hamt;
+
+    // A set of ids, with an index of their names
+    shared_trie_group<int, std::string> group;
+
+    SECTION( "commits together" ) {
+        group.update_with( []( hash_trie<int>& ids, hash_trie<std::string>& names ) {
+            ids.insert( 1 );
+            names.insert( "one" );
+        } );
+        CHECK( group.version() == 1 );
+
+        auto [ids, names] = group.get_all();
+        CHECK( ids.contains( 1 ) );
+        CHECK( names.contains( "one" ) );
+        CHECK( group.get<1>().size() == 1 );
+
+        auto trans1 = group.start_transaction();
+        auto trans2 = group.start_transaction();
+        trans1.get<0>().insert( 2 );
+        trans2.get<1>().insert( "two" );
+        CHECK( trans1.try_commit() );
+        CHECK_FALSE( trans2.try_commit() ); // (rebased, so now sees trans1's commit)
+        CHECK( trans2.get<0>().contains( 2 ) );
+        CHECK_FALSE( trans2.get<1>().contains( "two" ) );
+    }
+    SECTION( "readers never see a torn state" ) {
+        const int writers = 3;
+        const int perWriter = 300;
+        std::atomic<bool> done { false };
+        std::atomic<int> tornReads { 0 };
+
+        std::vector<std::thread> readers;
+        for( int i = 0; i < 2; ++i ) {
+            readers.emplace_back( [&] {
+                while( !done ) {
+                    auto tries = group.get_all();
+                    if( std::get<0>( tries ).size() != std::get<1>( tries ).size() )
+                        ++tornReads;
+                }
+            } );
+        }
+        std::vector<std::thread> threads;
+        for( int t = 0; t < writers; ++t ) {
+            threads.emplace_back( [&, t] {
+                for( int i = 0; i < perWriter; ++i ) {
+                    auto id = t * perWriter + i;
+                    group.update_with( [id]( hash_trie<int>& ids, hash_trie<std::string>& names ) {
+                        ids.insert( id );
+                        names.insert( "name" + std::to_string( id ) );
+                    } );
+                }
+            } );
+        }
+        for( auto& thread : threads )
+            thread.join();
+        done = true;
+        for( auto& thread : readers )
+            thread.join();
+
+        CHECK( tornReads == 0 );
+        CHECK( group.get<0>().size() == writers * perWriter );
+        CHECK( group.get<1>().size() == writers * perWriter );
+    }
+}
+
+TEST_CASE( "concurrent_hash_trie" ) {
+
+    using namespace hamt;
+
+    concurrent_hash_trie<std::string> ct;
+    REQUIRE( ct.empty() );
+
+    REQUIRE( ct.insert( "one" ) );
+    REQUIRE( ct.insert( "two" ) );
+    REQUIRE_FALSE( ct.insert( "two" ) );
+    REQUIRE( ct.size() == 2 );
+    REQUIRE( ct.contains( "one" ) );
+    REQUIRE_FALSE( ct.contains( "three" ) );
+
+    SECTION( "erase" ) {
+        REQUIRE( ct.erase( "one" ) );
+        REQUIRE_FALSE( ct.erase( "one" ) );
+        REQUIRE( ct.size() == 1 );
+    }
+    SECTION( "for_each" ) {
+        std::vector<std::string> values;
+        ct.for_each( [&]( std::string const& value ) { values.push_back( value ); } );
+        std::sort( values.begin(), values.end() );
+        REQUIRE( values == std::vector<std::string>{ "one", "two" } );
+    }
+    SECTION( "snapshots are independent" ) {
+        auto snapshot = ct.snapshot();
+        ct.insert( "three" );
+        snapshot.erase( "one" );
+        snapshot.insert( "four" );
+
+        REQUIRE( ct.size() == 3 );
+        REQUIRE( ct.contains( "one" ) );
+        REQUIRE_FALSE( ct.contains( "four" ) );
+
+        REQUIRE( snapshot.size() == 2 );
+        REQUIRE( snapshot.contains( "four" ) );
+        REQUIRE_FALSE( snapshot.contains( "three" ) );
+
+        auto snapshotOfSnapshot = snapshot.snapshot();
+        snapshot.insert( "five" );
+        REQUIRE( snapshotOfSnapshot.size() == 2 );
+    }
+}
+
+TEST_CASE( "concurrent_hash_trie writers and snapshots" ) {
+
+    using namespace hamt;
+
+    concurrent_hash_trie<int> ct;
+    constexpr int writerCount = 4;
+    constexpr int valuesPerWriter = 2000;
+    std::atomic<bool> done { false };
+    std::atomic<int> inconsistentSnapshots { 0 };
+
+    // Each writer inserts its values in order, so any consistent snapshot must hold
+    // some prefix of each writer's values
+    std::thread snapshotter( [&] {
+        while( !done ) {
+            auto snapshot = ct.snapshot();
+            for( int w = 0; w < writerCount; ++w ) {
+                int count = 0;
+                snapshot.for_each( [&]( int value ) {
+                    if( value / valuesPerWriter == w )
+                        ++count;
+                } );
+                for( int i = 0; i < count; ++i ) {
+                    if( !snapshot.contains( w*valuesPerWriter + i ) )
+                        ++inconsistentSnapshots;
+                }
+            }
+        }
+    } );
+    std::vector<std::thread> writers;
+    for( int w = 0; w < writerCount; ++w ) {
+        writers.emplace_back( [&, w] {
+            for( int i = 0; i < valuesPerWriter; ++i )
+                ct.insert( w*valuesPerWriter + i );
+        } );
+    }
+    for( auto& writer : writers )
+        writer.join();
+    done = true;
+    snapshotter.join();
+
+    REQUIRE( inconsistentSnapshots == 0 );
+    REQUIRE( ct.size() == writerCount*valuesPerWriter );
+
+    writers.clear();
+    for( int w = 0; w < writerCount; ++w ) {
+        writers.emplace_back( [&, w] {
+            for( int i = 0; i < valuesPerWriter; i += 2 )
+                ct.erase( w*valuesPerWriter + i + 1 );
+        } );
+    }
+    for( auto& writer : writers )
+        writer.join();
+    REQUIRE( ct.size() == writerCount*valuesPerWriter/2 );
+    for( int w = 0; w < writerCount; ++w ) {
+        REQUIRE( ct.contains( w*valuesPerWriter ) );
+        REQUIRE_FALSE( ct.contains( w*valuesPerWriter + 1 ) );
+    }
+}
+
+TEST_CASE( "async commits" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+
+    SECTION( "inline" ) {
+        inline_executor executor;
+        async_committer<int, inline_executor> committer( sh, executor );
+        auto future = committer.commit_async( []( hash_trie<int>& h ) {
+            h.insert( 1 );
+            return h.size();
+        } ).get_future();
+        REQUIRE( future.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready );
+        CHECK( future.get() == 1 );
+        CHECK( sh.get().contains( 1 ) );
+    }
+    SECTION( "on a committer thread" ) {
+        const int threadCount = 4;
+        const int perThread = 100;
+        thread_executor executor;
+        async_committer<int, thread_executor> committer( sh, executor );
+
+        std::vector<std::future<void>> futures[threadCount];
+        std::vector<std::thread> threads;
+        for( int t = 0; t < threadCount; ++t ) {
+            threads.emplace_back( [&, t] {
+                for( int i = 0; i < perThread; ++i ) {
+                    auto value = t * perThread + i;
+                    futures[t].push_back( committer.commit_async( [value]( hash_trie<int>& h ) {
+                        h.insert( value );
+                    } ).get_future() );
+                }
+            } );
+        }
+        for( auto& thread : threads )
+            thread.join();
+
+        // One that fails doesn't affect the others
+        auto failed = committer.commit_async( []( hash_trie<int>& h ) -> bool {
+            h.insert( -1 );
+            throw std::runtime_error( "failed" );
+        } ).get_future();
+        auto after = committer.commit_async( []( hash_trie<int>& h ) { return h.contains( -1 ); } ).get_future();
+
+        for( auto& threadFutures : futures )
+            for( auto& future : threadFutures )
+                future.get();
+        CHECK_THROWS_AS( failed.get(), std::runtime_error );
+        CHECK_FALSE( after.get() );
+        CHECK( sh.get().size() == threadCount * perThread );
+        // (updates submitted together are committed together, so there are fewer commits than updates)
+        CHECK( sh.version() <= threadCount * perThread );
+    }
+    SECTION( "destroyed as soon as the last update completes" ) {
+        thread_executor executor;
+        for( int i = 0; i < 200; ++i ) {
+            async_committer<int, thread_executor> committer( sh, executor );
+            committer.commit_async( [i]( hash_trie<int>& h ) { h.insert( i ); } ).get_future().get();
+            // (the executor's thread may still be finishing the drain that completed it)
+        }
+        CHECK( sh.get().size() == 200 );
+    }
+}
+
+TEST_CASE( "deferred release" ) {
+
+    using namespace hamt;
+
+    struct deferring {
+        deferring() { set_release_mode( release_mode::deferred ); }
+        ~deferring() {
+            set_release_mode( release_mode::immediate );
+            drain_releases();
+        }
+    } deferred;
+
+    SECTION( "drained a bit at a time" ) {
+        {
+            hash_trie<int> h;
+            for( int i = 0; i < 10000; ++i )
+                h.insert( i );
+            drain_releases(); // (anything replaced while building it)
+        }
+        // Only the root was queued - its children are only released when it is freed
+        CHECK( drain_releases( 1 ) == 1 );
+        CHECK( drain_releases( 10 ) == 10 );
+        CHECK( drain_releases() > 0 );
+        CHECK( drain_releases() == 0 );
+    }
+    SECTION( "in the background" ) {
+        background_reclaimer reclaimer( std::chrono::milliseconds( 1 ) );
+        shared_hash_trie<int> sh;
+        for( int i = 0; i < 1000; ++i )
+            sh.update_with( [i]( hash_trie<int>& h ) { h.insert( i ); } );
+        CHECK( sh.get().size() == 1000 );
+    }
+}
+
+TEST_CASE( "parallel build" ) {
+
+    using namespace hamt;
+
+    thread_pool_executor executor( 4 );
+
+    SECTION( "ints" ) {
+        std::vector<int> values;
+        for( int i = 0; i < 100000; ++i )
+            values.push_back( i * 7 );
+        values.push_back( 7 ); // (a duplicate)
+
+        auto h = hash_trie<int>::parallel_from_range( values.begin(), values.end(), executor );
+        REQUIRE( h.size() == 100000 );
+        for( auto value : values )
+            CHECK( h.contains( value ) );
+        CHECK_FALSE( h.contains( 1 ) );
+
+        // It is an ordinary trie, that can be updated as any other
+        h.insert( 1 );
+        CHECK( h.erase( 7 ) );
+        CHECK( h.size() == 100000 );
+    }
+    SECTION( "strings" ) {
+        std::vector<std::string> values;
+        // (each one twice, so each is met in two different pieces)
+        for( int i = 0; i < 100000; ++i )
+            values.push_back( "value " + std::to_string( i % 50000 ) );
+
+        auto h = hash_trie<std::string>::parallel_from_range( values.begin(), values.end(), executor );
+        REQUIRE( h.size() == 50000 );
+        for( auto const& value : values )
+            CHECK( h.contains( value ) );
+
+        // The pieces were merged into a well formed trie
+        for( int i = 0; i < 50000; ++i )
+            REQUIRE( h.erase( "value " + std::to_string( i ) ) );
+        CHECK( h.empty() );
+    }
+    SECTION( "small and empty ranges" ) {
+        std::vector<int> values { 1, 2, 3 };
+        CHECK( hash_trie<int>::parallel_from_range( values.begin(), values.end(), executor ).size() == 3 );
+        CHECK( hash_trie<int>::parallel_from_range( values.begin(), values.begin(), executor ).empty() );
+
+        inline_executor inlineExecutor;
+        CHECK( hash_trie<int>::parallel_from_range( values.begin(), values.end(), inlineExecutor ).size() == 3 );
+    }
+}
+
+TEST_CASE( "parallel algorithms" ) {
+
+    using namespace hamt;
+
+    thread_pool_executor executor( 4 );
+
+    SECTION( "ints" ) {
+        hash_trie<int> h;
+        long long expectedSum = 0;
+        for( int i = 0; i < 100000; ++i ) {
+            h.insert( i * 3 );
+            expectedSum += i * 3;
+        }
+        auto check = [&] {
+            std::atomic<size_t> visited { 0 };
+            parallel::for_each( h, executor, [&]( int ) { visited++; } );
+            CHECK( visited == h.size() );
+
+            CHECK( parallel::count_if( h, executor, []( int value ) { return value % 2 == 0; } ) == 50000 );
+            CHECK( parallel::transform_reduce( h, executor, 0LL, std::plus<long long>(),
+                                               []( int value ) { return static_cast<long long>( value ); } ) == expectedSum );
+        };
+        check();
+
+        // (and with level-compressed branches)
+        h.compact();
+        check();
+    }
+    SECTION( "strings" ) {
+        hash_trie<std::string> h;
+        for( int i = 0; i < 20000; ++i )
+            h.insert( std::to_string( i ) );
+
+        auto longest = parallel::transform_reduce( h, executor, size_t(0),
+                                                   []( size_t a, size_t b ) { return std::max( a, b ); },
+                                                   []( std::string const& value ) { return value.size(); } );
+        CHECK( longest == 5 );
+        CHECK( parallel::count_if( h, executor, []( std::string const& value ) { return value[0] == '1'; } ) == 11111 );
+    }
+    SECTION( "small and empty tries" ) {
+        hash_trie<int> h;
+        CHECK( parallel::count_if( h, executor, []( int ) { return true; } ) == 0 );
+        CHECK( parallel::transform_reduce( h, executor, 42, std::plus<int>(), []( int value ) { return value; } ) == 42 );
+
+        h.insert( 1 );
+        h.insert( 2 );
+        inline_executor inlineExecutor;
+        CHECK( parallel::transform_reduce( h, inlineExecutor, 42, std::plus<int>(), []( int value ) { return value; } ) == 45 );
+    }
+    SECTION( "exceptions" ) {
+        hash_trie<int> h;
+        for( int i = 0; i < 1000; ++i )
+            h.insert( i );
+        CHECK_THROWS_AS( parallel::for_each( h, executor, []( int value ) {
+            if( value == 500 )
+                throw std::runtime_error( "failed" );
+        } ), std::runtime_error );
+    }
+}
+
+TEST_CASE( "sharded_shared_hash_trie" ) {
+
+    using namespace hamt;
+
+    sharded_shared_hash_trie<std::string, 8> sh;
+    for( int i = 0; i < 100; ++i )
+        sh.insert( std::to_string( i ) );
+    sh.erase( "42" );
+
+    REQUIRE( sh.size() == 99 );
+    REQUIRE( sh.contains( "7" ) );
+    REQUIRE_FALSE( sh.contains( "42" ) );
+
+    SECTION( "values are spread across the shards" ) {
+        size_t used = 0;
+        for( size_t i = 0; i < sh.shards; ++i )
+            used += sh.shard( i ).get().empty() ? 0 : 1;
+        REQUIRE( used == sh.shards );
+    }
+    SECTION( "per-shard updates" ) {
+        auto index = sh.shard_of( "42" );
+        sh.update_shard_with( index, []( hash_trie<std::string>& h ) { h.insert( "42" ); } );
+        REQUIRE( sh.contains( "42" ) );
+        REQUIRE( sh.shard( index ).get().contains( "42" ) );
+    }
+    SECTION( "snapshot" ) {
+        auto snapshot = sh.snapshot();
+        sh.insert( "100" );
+        REQUIRE( snapshot.size() == 99 );
+        REQUIRE_FALSE( snapshot.contains( "100" ) );
+        REQUIRE( snapshot.contains( "99" ) );
+
+        size_t count = 0;
+        snapshot.for_each( [&]( std::string const& ) { ++count; } );
+        REQUIRE( count == 99 );
+    }
+}
+
+TEST_CASE( "sharded_shared_hash_trie writers and snapshots" ) {
+
+    using namespace hamt;
+
+    sharded_shared_hash_trie<int, 16> sh;
+    constexpr int writerCount = 4;
+    constexpr int valuesPerWriter = 1000;
+    std::atomic<bool> done { false };
+    std::atomic<int> inconsistentSnapshots { 0 };
+
+    // As for concurrent_hash_trie: each writer inserts in order, so every snapshot
+    // must hold a prefix of each writer's values
+    std::thread snapshotter( [&] {
+        while( !done ) {
+            auto snapshot = sh.snapshot();
+            std::vector<int> counts( writerCount, 0 );
+            snapshot.for_each( [&]( int value ) { ++counts[value / valuesPerWriter]; } );
+            for( int w = 0; w < writerCount; ++w ) {
+                for( int i = 0; i < counts[w]; ++i ) {
+                    if( !snapshot.contains( w*valuesPerWriter + i ) )
+                        ++inconsistentSnapshots;
+                }
+            }
+        }
+    } );
+    std::vector<std::thread> writers;
+    for( int w = 0; w < writerCount; ++w ) {
+        writers.emplace_back( [&, w] {
+            for( int i = 0; i < valuesPerWriter; ++i )
+                sh.insert( w*valuesPerWriter + i );
+        } );
+    }
+    for( auto& writer : writers )
+        writer.join();
+    done = true;
+    snapshotter.join();
+
+    REQUIRE( inconsistentSnapshots == 0 );
+    REQUIRE( sh.snapshot().size() == writerCount*valuesPerWriter );
+}
+
+TEST_CASE( "combining commits" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+    hash_trie_combiner<int> combiner( sh );
+
+    SECTION( "single thread" ) {
+        REQUIRE( combiner.insert( 1 ) );
+        REQUIRE_FALSE( combiner.insert( 1 ) );
+        REQUIRE( combiner.erase( 1 ) );
+        REQUIRE_FALSE( combiner.erase( 1 ) );
+        REQUIRE( sh.get().empty() );
+    }
+    SECTION( "many threads" ) {
+        constexpr int threadCount = 8;
+        constexpr int valuesPerThread = 500;
+        std::atomic<int> inserted { 0 };
+        std::atomic<int> erased { 0 };
+
+        // Every thread inserts (then erases) every value, so exactly one of each should report success
+        auto runThreads = [&]( auto const& task ) {
+            std::vector<std::thread> threads;
+            for( int t = 0; t < threadCount; ++t )
+                threads.emplace_back( task );
+            // (with a direct committer mixed in)
+            threads.emplace_back( [&] {
+                for( int i = 0; i < 50; ++i )
+                    sh.update_with( [&]( hash_trie<int>& h ) { h.insert( valuesPerThread + i ); } );
+            } );
+            for( auto& thread : threads )
+                thread.join();
+        };
+        runThreads( [&] {
+            for( int i = 0; i < valuesPerThread; ++i ) {
+                if( combiner.insert( i ) )
+                    ++inserted;
+            }
+        } );
+        runThreads( [&] {
+            for( int i = 0; i < valuesPerThread; i += 2 ) {
+                if( combiner.erase( i ) )
+                    ++erased;
+            }
+        } );
+
+        REQUIRE( inserted == valuesPerThread );
+        REQUIRE( erased == valuesPerThread/2 );
+        REQUIRE( sh.get().size() == valuesPerThread/2 + 50 );
+    }
+    SECTION( "operations that throw" ) {
+        shared_hash_trie<fragile> fragiles;
+        hash_trie_combiner<fragile> fragileCombiner( fragiles );
+
+        REQUIRE( fragileCombiner.insert( fragile( 1 ) ) );
+        REQUIRE_THROWS_AS( fragileCombiner.insert( fragile( -1 ) ), std::runtime_error );
+        // The combiner is still usable, and the failed insert left nothing behind
+        REQUIRE( fragileCombiner.insert( fragile( 2 ) ) );
+        REQUIRE( fragiles.get().size() == 2 );
+
+        // Only the operation that threw fails, not the others combined with it
+        constexpr int threadCount = 4;
+        constexpr int valuesPerThread = 200;
+        std::atomic<int> failed { 0 };
+        std::vector<std::thread> threads;
+        for( int t = 0; t < threadCount; ++t ) {
+            threads.emplace_back( [&, t] {
+                for( int i = 0; i < valuesPerThread; ++i ) {
+                    auto value = 10 + t * valuesPerThread + i;
+                    try {
+                        fragileCombiner.insert( fragile( t == 0 ? -value : value ) );
+                    }
+                    catch( std::runtime_error const& ) {
+                        ++failed;
+                    }
+                }
+            } );
+        }
+        for( auto& thread : threads )
+            thread.join();
+        REQUIRE( failed == valuesPerThread );
+        REQUIRE( fragiles.get().size() == 2 + ( threadCount-1 ) * valuesPerThread );
+    }
+}
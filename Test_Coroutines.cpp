@@ -0,0 +1,88 @@
+#include "hash_trie.hpp"
+
+#include "catch.hpp"
+
+// Only built as part of HamtTest20 (see CMakeLists.txt), as co_await needs C++20
+#ifdef HAMT_HAS_COROUTINES
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+    // A coroutine that starts straight away, and that nothing waits for
+    struct fire_and_forget {
+        struct promise_type {
+            auto get_return_object() -> fire_and_forget { return {}; }
+            auto initial_suspend() noexcept -> std::suspend_never { return {}; }
+            auto final_suspend() noexcept -> std::suspend_never { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    struct outcome {
+        size_t sizeAfterInsert = 0;
+        bool sawError = false;
+        std::atomic<bool> finished { false };
+    };
+
+    template<typename Committer>
+    auto insert_then_fail( Committer& committer, int value, outcome& result ) -> fire_and_forget {
+        result.sizeAfterInsert = co_await committer.commit_async( [value]( hamt::hash_trie<int>& h ) {
+            h.insert( value );
+            return h.size();
+        } );
+        try {
+            co_await committer.commit_async( []( hamt::hash_trie<int>& h ) -> bool {
+                h.insert( -1 );
+                throw std::runtime_error( "failed" );
+            } );
+        }
+        catch( std::runtime_error const& ) {
+            result.sawError = true;
+        }
+        result.finished = true;
+    }
+}
+
+TEST_CASE( "co_await commits" ) {
+
+    using namespace hamt;
+
+    shared_hash_trie<int> sh;
+
+    SECTION( "inline" ) {
+        inline_executor executor;
+        async_committer<int, inline_executor> committer( sh, executor );
+        outcome result;
+        insert_then_fail( committer, 1, result );
+
+        // (the executor runs everything as it is submitted, so the coroutine has already finished)
+        REQUIRE( result.finished );
+        CHECK( result.sizeAfterInsert == 1 );
+        CHECK( result.sawError );
+    }
+    SECTION( "resumed on a committer thread" ) {
+        constexpr int coroutineCount = 50;
+        outcome results[coroutineCount];
+        {
+            thread_executor executor;
+            async_committer<int, thread_executor> committer( sh, executor );
+            for( int i = 0; i < coroutineCount; ++i )
+                insert_then_fail( committer, i, results[i] );
+            for( auto& result : results ) {
+                while( !result.finished )
+                    std::this_thread::yield();
+            }
+        }
+        for( auto& result : results ) {
+            CHECK( result.sizeAfterInsert >= 1 );
+            CHECK( result.sawError );
+        }
+        CHECK( sh.get().size() == coroutineCount );
+        CHECK_FALSE( sh.get().contains( -1 ) );
+    }
+}
+
+#endif // HAMT_HAS_COROUTINES
@@ -2,8 +2,13 @@
 
 #include "catch.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <set>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
 TEST_CASE( "iterate" ) {
 
@@ -43,3 +48,415 @@ TEST_CASE( "iterate" ) {
         }
     }
 }
+
+
+TEST_CASE( "erase" ) {
+
+    using namespace hamt;
+
+    const int num = 1000;
+
+    hash_trie<int> h;
+    for( int i=0; i < num; ++i )
+        h.insert( i );
+
+    CHECK_FALSE( h.erase( num ) );
+    CHECK( h.size() == num );
+
+    for( int i=0; i < num; i += 2 )
+        CHECK( h.erase( i ) );
+    CHECK( h.size() == num/2 );
+
+    for( int i=0; i < num; ++i )
+        CHECK( h.contains( i ) == (i % 2 == 1) );
+
+    int count = 0;
+    for( auto it = h.begin(), itEnd = h.end(); it != itEnd; ++it ) {
+        CHECK( *it % 2 == 1 );
+        count++;
+    }
+    CHECK( count == num/2 );
+
+    for( int i=1; i < num; i += 2 )
+        CHECK( h.erase( i ) );
+    CHECK( h.empty() );
+    CHECK( h.begin() == h.end() );
+}
+
+TEST_CASE( "long shared hash prefixes" ) {
+
+    using namespace hamt;
+
+    // These only differ in the top bits of the hash, so share long prefixes
+    std::vector<size_t> values;
+    for( size_t i=0; i < 64; ++i )
+        values.push_back( ( i << 58 ) | 0x2a5 );
+
+    hash_trie<size_t> h;
+    for( auto v : values )
+        h.insert( v );
+    CHECK( h.size() == values.size() );
+
+    for( auto v : values ) {
+        auto p = h.find( v );
+        REQUIRE( p.kind() == child_kind::inline_value );
+        CHECK( p.size() <= 2 ); // root, and at most two real branch points below it
+    }
+
+    for( size_t i=0; i < values.size(); i += 3 )
+        CHECK( h.erase( values[i] ) );
+    for( size_t i=0; i < values.size(); ++i )
+        CHECK( h.contains( values[i] ) == (i % 3 != 0) );
+}
+
+TEST_CASE( "compact" ) {
+
+    using namespace hamt;
+
+    const size_t num = 20000;
+
+    hash_trie<size_t> h;
+    for( size_t i=0; i < num; ++i )
+        h.insert( std::hash<std::string>()( std::to_string( i ) ) );
+
+    h.compact();
+    CHECK( h.size() == num );
+
+    size_t count = 0;
+    for( auto it = h.begin(), itEnd = h.end(); it != itEnd; ++it )
+        count++;
+    CHECK( count == num );
+
+    // Keeps working as the compacted subtrees are modified
+    for( size_t i=0; i < num; i += 2 )
+        CHECK( h.erase( std::hash<std::string>()( std::to_string( i ) ) ) );
+    for( size_t i=num; i < num + 100; ++i )
+        h.insert( std::hash<std::string>()( std::to_string( i ) ) );
+
+    for( size_t i=0; i < num + 100; ++i )
+        CHECK( h.contains( std::hash<std::string>()( std::to_string( i ) ) ) == (i >= num || i % 2 == 1) );
+}
+
+TEST_CASE( "contains" ) {
+
+    using namespace hamt;
+
+    hash_trie<std::string> h;
+    for( int i=0; i < 1000; ++i )
+        h.insert( std::to_string( i ) );
+
+    for( int i=0; i < 1000; ++i )
+        CHECK( h.contains( std::to_string( i ) ) );
+    for( int i=1000; i < 2000; ++i )
+        CHECK_FALSE( h.contains( std::to_string( i ) ) );
+    CHECK_FALSE( h.contains( "" ) );
+
+    SECTION( "by string_view" ) {
+        std::string_view digits = "0123456789";
+        CHECK( h.contains( digits.substr( 1, 3 ) ) );
+        CHECK_FALSE( h.contains( digits.substr( 0, 3 ) ) );
+    }
+}
+
+TEST_CASE( "long strings" ) {
+
+    using namespace hamt;
+
+    std::set<std::string> expected;
+    hash_trie<std::string> h;
+    for( int i=0; i < 1000; ++i ) {
+        auto s = std::string( 40, 'x' ) + std::to_string( i );
+        h.insert( s );
+        expected.insert( s );
+    }
+    CHECK( h.size() == 1000 );
+    CHECK( h.contains( std::string( 40, 'x' ) + "42" ) );
+    CHECK_FALSE( h.contains( std::string( 40, 'x' ) ) );
+
+    std::set<std::string> actual;
+    for( auto it = h.begin(); it != h.end(); ++it )
+        actual.insert( *it );
+    CHECK( actual == expected );
+}
+
+TEST_CASE( "dense integer ranges" ) {
+
+    using namespace hamt;
+
+    std::set<int> expected;
+    hash_trie<int> h;
+    for( int i = -5000; i < 5000; ++i ) {
+        h.insert( i );
+        expected.insert( i );
+    }
+    CHECK( h.size() == expected.size() );
+
+    for( int i = -5000; i < 5000; i += 3 ) {
+        CHECK( h.erase( i ) );
+        expected.erase( i );
+    }
+    CHECK( h.size() == expected.size() );
+    h.compact();
+
+    for( int i = -6000; i < 6000; ++i )
+        CHECK( h.contains( i ) == ( expected.count( i ) != 0 ) );
+
+    std::set<int> actual;
+    for( auto it = h.begin(); it != h.end(); ++it )
+        actual.insert( *it );
+    CHECK( actual == expected );
+}
+
+TEST_CASE( "empty tries" ) {
+
+    using namespace hamt;
+
+    static_assert( std::is_nothrow_default_constructible<hash_trie<std::string>>::value, "" );
+    static_assert( std::is_nothrow_move_constructible<hash_trie<std::string>>::value, "" );
+    static_assert( std::is_nothrow_move_assignable<hash_trie<std::string>>::value, "" );
+
+    hash_trie<int> empty;
+    auto emptyRoot = empty.data().m_root;
+
+    hash_trie<int> h;
+    CHECK( h.data().m_root == emptyRoot );
+    h.insert( 1 );
+    h.insert( 2 );
+    CHECK( h.data().m_root != emptyRoot );
+
+    SECTION( "erasing everything" ) {
+        CHECK( h.erase( 1 ) );
+        CHECK( h.erase( 2 ) );
+        CHECK( h.data().m_root == emptyRoot );
+        CHECK( h.begin() == h.end() );
+    }
+    SECTION( "clear" ) {
+        h.clear();
+        CHECK( h.empty() );
+        CHECK( h.data().m_root == emptyRoot );
+        h.insert( 3 );
+        CHECK( h.contains( 3 ) );
+    }
+    SECTION( "moves" ) {
+        std::vector<hash_trie<int>> tries;
+        for( int i = 0; i < 100; ++i ) {
+            tries.emplace_back();
+            tries.back().insert( i );
+        }
+        for( int i = 0; i < 100; ++i )
+            CHECK( tries[i].contains( i ) );
+
+        hash_trie<int> moved = std::move( h );
+        CHECK( moved.size() == 2 );
+        CHECK( h.empty() );
+        h = std::move( moved );
+        CHECK( h.size() == 2 );
+    }
+}
+
+TEST_CASE( "diff" ) {
+
+    using namespace hamt;
+
+    hash_trie<int> before;
+    for( int i = 0; i < 20000; ++i )
+        before.insert( i * 7 );
+
+    std::set<int> added, removed;
+    auto onAdded = [&]( int value ) { added.insert( value ); };
+    auto onRemoved = [&]( int value ) { removed.insert( value ); };
+
+    SECTION( "identical" ) {
+        auto after = before;
+        diff( before, after, onAdded, onRemoved );
+        CHECK( added.empty() );
+        CHECK( removed.empty() );
+    }
+    SECTION( "a few changes" ) {
+        auto after = before;
+        after.insert( 1 );
+        after.insert( 200000 );
+        after.erase( 70 );
+        after.erase( 7000 );
+        after.insert( 7000 ); // (put back, but as a new node)
+
+        diff( before, after, onAdded, onRemoved );
+        CHECK( added == std::set<int>{ 1, 200000 } );
+        CHECK( removed == std::set<int>{ 70 } );
+    }
+    SECTION( "many changes" ) {
+        auto after = before;
+        std::set<int> expectedAdded, expectedRemoved;
+        for( int i = 0; i < 20000; i += 3 ) {
+            after.erase( i * 7 );
+            expectedRemoved.insert( i * 7 );
+        }
+        for( int i = 0; i < 5000; ++i ) {
+            after.insert( i * 7 + 1 );
+            expectedAdded.insert( i * 7 + 1 );
+        }
+
+        diff( before, after, onAdded, onRemoved );
+        CHECK( added == expectedAdded );
+        CHECK( removed == expectedRemoved );
+
+        // And the other way around
+        added.clear();
+        removed.clear();
+        diff( after, before, onAdded, onRemoved );
+        CHECK( added == expectedRemoved );
+        CHECK( removed == expectedAdded );
+    }
+    SECTION( "different structure, same values" ) {
+        auto after = before;
+        after.compact();
+        REQUIRE( after.data().m_root != before.data().m_root );
+
+        diff( before, after, onAdded, onRemoved );
+        CHECK( added.empty() );
+        CHECK( removed.empty() );
+    }
+    SECTION( "from empty" ) {
+        diff( hash_trie<int>(), before, onAdded, onRemoved );
+        CHECK( added.size() == before.size() );
+        CHECK( removed.empty() );
+    }
+    SECTION( "strings" ) {
+        hash_trie<std::string> oldStrings;
+        for( int i = 0; i < 1000; ++i )
+            oldStrings.insert( "value" + std::to_string( i ) );
+        auto newStrings = oldStrings;
+        newStrings.erase( "value10" );
+        newStrings.insert( "new value" );
+
+        std::vector<std::string> addedStrings, removedStrings;
+        diff( oldStrings, newStrings,
+              [&]( std::string const& value ) { addedStrings.push_back( value ); },
+              [&]( std::string const& value ) { removedStrings.push_back( value ); } );
+        CHECK( addedStrings == std::vector<std::string>{ "new value" } );
+        CHECK( removedStrings == std::vector<std::string>{ "value10" } );
+    }
+}
+
+TEST_CASE( "set operations" ) {
+
+    using namespace hamt;
+
+    auto toSet = []( hash_trie<int> const& h ) {
+        std::set<int> values;
+        for( auto value : hash_trie_view<int>( h ) )
+            values.insert( value );
+        return values;
+    };
+    auto setUnion = []( std::set<int> const& a, std::set<int> const& b ) {
+        std::set<int> result;
+        std::set_union( a.begin(), a.end(), b.begin(), b.end(), std::inserter( result, result.end() ) );
+        return result;
+    };
+    auto setIntersection = []( std::set<int> const& a, std::set<int> const& b ) {
+        std::set<int> result;
+        std::set_intersection( a.begin(), a.end(), b.begin(), b.end(), std::inserter( result, result.end() ) );
+        return result;
+    };
+    auto setDifference = []( std::set<int> const& a, std::set<int> const& b ) {
+        std::set<int> result;
+        std::set_difference( a.begin(), a.end(), b.begin(), b.end(), std::inserter( result, result.end() ) );
+        return result;
+    };
+    auto checkAll = [&]( hash_trie<int> const& a, hash_trie<int> const& b ) {
+        auto aValues = toSet( a );
+        auto bValues = toSet( b );
+        CHECK( toSet( set_union( a, b ) ) == setUnion( aValues, bValues ) );
+        CHECK( toSet( set_intersection( a, b ) ) == setIntersection( aValues, bValues ) );
+        CHECK( toSet( set_difference( a, b ) ) == setDifference( aValues, bValues ) );
+        CHECK( toSet( set_difference( b, a ) ) == setDifference( bValues, aValues ) );
+        CHECK( set_union( a, b ).size() == setUnion( aValues, bValues ).size() );
+
+        // The difference is built from a's nodes, rather than by inserting, so check that it
+        // is still well formed: every value can be erased again (in debug, erase asserts that
+        // branches have collapsed as they should)
+        auto difference = set_difference( a, b );
+        auto differenceValues = toSet( difference );
+        CHECK( difference.size() == differenceValues.size() );
+        for( auto value : differenceValues )
+            difference.erase( value );
+        CHECK( difference.empty() );
+    };
+
+    hash_trie<int> active;
+    for( int i = 0; i < 20000; ++i )
+        active.insert( i * 3 );
+
+    SECTION( "versions of the same trie" ) {
+        auto later = active;
+        for( int i = 0; i < 100; ++i ) {
+            later.erase( i * 300 );
+            later.insert( i * 300 + 1 );
+        }
+        checkAll( active, later );
+
+        // Most of the result is shared with the inputs
+        auto both = set_intersection( active, later );
+        CHECK( detail::unshared_bytes( both.data().m_root, later.data().m_root ) * 4
+               < detail::subtree_bytes( both.data().m_root ) );
+        auto onlyActive = set_difference( active, later );
+        CHECK( onlyActive.size() == 100 );
+    }
+    SECTION( "level compressed tries" ) {
+        auto compacted = active;
+        compacted.compact();
+        auto later = compacted;
+        for( int i = 0; i < 15000; ++i )
+            later.erase( i * 3 );
+        checkAll( compacted, later );
+
+        // (so little is left of the level compressed branches that they are narrowed again)
+        auto fewer = compacted;
+        for( int i = 0; i < 100; ++i )
+            fewer.erase( i * 300 );
+        checkAll( compacted, fewer );
+        checkAll( compacted, active );
+    }
+    SECTION( "a much smaller trie" ) {
+        hash_trie<int> revoked;
+        for( int i = 0; i < 100; ++i )
+            revoked.insert( i * 5 );
+        checkAll( active, revoked );
+
+        auto remaining = set_difference( active, revoked );
+        CHECK( remaining.size() == active.size() - 34 );
+    }
+    SECTION( "unrelated tries" ) {
+        hash_trie<int> other;
+        for( int i = 0; i < 15000; ++i )
+            other.insert( i * 2 );
+        checkAll( active, other );
+    }
+    SECTION( "identical and empty tries" ) {
+        auto same = active;
+        CHECK( set_union( active, same ).data().m_root == active.data().m_root );
+        CHECK( set_intersection( active, same ).data().m_root == active.data().m_root );
+        CHECK( set_difference( active, same ).empty() );
+
+        hash_trie<int> empty;
+        checkAll( active, empty );
+        CHECK( set_union( empty, active ).data().m_root == active.data().m_root );
+    }
+    SECTION( "strings" ) {
+        hash_trie<std::string> a, b;
+        for( int i = 0; i < 1000; ++i ) {
+            a.insert( "value" + std::to_string( i ) );
+            b.insert( "value" + std::to_string( i + 500 ) );
+        }
+        CHECK( set_union( a, b ).size() == 1500 );
+        CHECK( set_intersection( a, b ).size() == 500 );
+        auto onlyA = set_difference( a, b );
+        CHECK( onlyA.size() == 500 );
+        CHECK( onlyA.contains( "value0" ) );
+        CHECK_FALSE( onlyA.contains( "value500" ) );
+
+        // The leaves that are left are a's own
+        CHECK( detail::unshared_bytes( onlyA.data().m_root, a.data().m_root ) * 2
+               < detail::subtree_bytes( onlyA.data().m_root ) );
+    }
+}
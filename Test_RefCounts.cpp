@@ -2,6 +2,8 @@
 
 #include "catch.hpp"
 
+#include <string>
+
 // These tests are only valid in a debug build
 #ifdef HAMT_DEBUG_RC
 
@@ -10,22 +12,23 @@ TEST_CASE("ref counts") {
 
     node::dbg_get_total_refs() = 0;
     {
-        hash_trie<int> h;
+        hash_trie<std::string> h;
 
+        // (empty tries share a root that is not ref counted)
         CHECK( h.size() == 0 );
-        CHECK(node::dbg_get_total_refs() == 1 );
+        CHECK(node::dbg_get_total_refs() == 0 );
 
-        h.insert(42);
+        h.insert("42");
 
         CHECK( h.size() == 1 );
         CHECK(node::dbg_get_total_refs() == 2 );
 
-        h.insert(42);
+        h.insert("42");
 
         CHECK( h.size() == 1 );
         CHECK(node::dbg_get_total_refs() == 2 );
 
-        h.insert(7);
+        h.insert("7");
 
         CHECK( h.size() == 2 );
         CHECK(node::dbg_get_total_refs() == 3 );
@@ -33,15 +36,244 @@ TEST_CASE("ref counts") {
     CHECK(node::dbg_get_total_refs() == 0 );
 }
 
+TEST_CASE("inline value ref counts") {
+    using namespace hamt;
+
+    node::dbg_get_total_refs() = 0;
+    {
+        hash_trie<int> h;
+
+        h.insert(42);
+        h.insert(7);
+
+        // integers are held in the root itself
+        CHECK( h.size() == 2 );
+        CHECK(node::dbg_get_total_refs() == 1 );
+
+        h.insert(43); // only differs from 42 in the final hash chunk
+
+        CHECK(node::dbg_get_total_refs() == 2 );
+    }
+    CHECK(node::dbg_get_total_refs() == 0 );
+}
+
 TEST_CASE( "hash patterns" ) {
     using namespace hamt;
 
+    node::dbg_get_total_refs() = 0;
+    {
+        hash_trie<int> h;
+
+        // (shifted past the final hash chunk)
+        h.insert(0b01000'00010'00001 << 4);
+        h.insert(0b00100'00010'00001 << 4); // differs only in third hash chunk
+
+        // root and one (prefix compressed) branch, holding both values
+        CHECK(node::dbg_get_total_refs() == 2 );
+    }
+    CHECK(node::dbg_get_total_refs() == 0 );
+}
+
+TEST_CASE( "empty ref counts" ) {
+    using namespace hamt;
+
+    node::dbg_get_total_refs() = 0;
+    {
+        hash_trie<int> h1;
+        hash_trie<int> h2 = h1;
+        hash_trie<int> h3 = std::move( h2 );
+        h1.insert( 42 );
+        CHECK(node::dbg_get_total_refs() == 1 );
+
+        h1.clear();
+        CHECK( h1.empty() );
+        CHECK(node::dbg_get_total_refs() == 0 );
+    }
+    CHECK(node::dbg_get_total_refs() == 0 );
+}
+
+TEST_CASE( "shared ref counts" ) {
+    using namespace hamt;
+
+    node::dbg_get_total_refs() = 0;
+    {
+        hash_trie<std::string> h;
+        h.insert( "a" );
+        h.insert( "b" );
+        CHECK(node::dbg_get_total_refs() == 3 );
+
+        shared_hash_trie<std::string> sh( h );
+        CHECK( sh.get().size() == 2 );
+        CHECK(node::dbg_get_total_refs() == 4 );
+    }
+    CHECK(node::dbg_get_total_refs() == 0 );
+}
+
+TEST_CASE( "transaction ref counts" ) {
+    using namespace hamt;
+
+    node::dbg_get_total_refs() = 0;
+    {
+        shared_hash_trie<int> sh;
+        sh.update_with( []( hash_trie<int>& h ) { h.insert( 1 ); } );
+        CHECK(node::dbg_get_total_refs() == 1 );
+        {
+            auto trans = sh.start_transaction();
+            CHECK(node::dbg_get_total_refs() == 2 );
+        }
+        CHECK(node::dbg_get_total_refs() == 1 );
+        {
+            auto trans1 = sh.start_transaction();
+            auto trans2 = sh.start_transaction();
+            auto h1 = trans1.get();
+            auto h2 = trans2.get();
+            h1.insert( 2 );
+            h2.insert( 3 );
+            CHECK( trans1.try_commit( h1 ) );
+            CHECK_FALSE( trans2.try_commit( h2 ) ); // rebases onto h1's root
+            // h1's root is held by sh, h1, trans1 and trans2, h2's root only by h2
+            // (each also has a bitmap node for the dense pair of values)
+            CHECK(node::dbg_get_total_refs() == 7 );
+        }
+        CHECK(node::dbg_get_total_refs() == 2 );
+    }
+    CHECK(node::dbg_get_total_refs() == 0 );
+}
+
+TEST_CASE( "epoch ref counts" ) {
+    using namespace hamt;
+
+    node::dbg_get_total_refs() = 0;
+    {
+        shared_hash_trie<std::string, epoch_reclamation> sh;
+        for( int i = 0; i < 10; ++i )
+            sh.update_with( [i]( hash_trie<std::string>& h ) { h.insert( std::to_string( i ) ); } );
+
+        // Reading takes no references
+        auto refs = node::dbg_get_total_refs().load();
+        sh.read( [&]( hash_trie_view<std::string> view ) {
+            CHECK( view.contains( "7" ) );
+            CHECK(node::dbg_get_total_refs() == refs );
+        } );
+
+        // Replaced roots are only released once collected
+        CHECK( epoch_reclamation::collect() );
+        CHECK(node::dbg_get_total_refs() < refs );
+    }
+    CHECK(node::dbg_get_total_refs() == 0 );
+}
+
+TEST_CASE( "snapshot cache ref counts" ) {
+    using namespace hamt;
+
+    node::dbg_get_total_refs() = 0;
+    {
+        shared_hash_trie<std::string> sh;
+        sh.update_with( []( hash_trie<std::string>& h ) { h.insert( "a" ); } );
+        CHECK(node::dbg_get_total_refs() == 2 );
+
+        snapshot_cache<std::string> cache( sh );
+        CHECK(node::dbg_get_total_refs() == 3 );
+
+        // Repeated reads don't touch the ref counts
+        for( int i = 0; i < 10; ++i )
+            CHECK( cache.get().contains( "a" ) );
+        CHECK(node::dbg_get_total_refs() == 3 );
+
+        {
+            auto snapshot = sh.borrow();
+            CHECK( snapshot->contains( "a" ) );
+            CHECK(node::dbg_get_total_refs() == 3 );
+        }
+    }
+    CHECK(node::dbg_get_total_refs() == 0 );
+}
+
+TEST_CASE( "concurrent_hash_trie ref counts" ) {
+    using namespace hamt;
+
+    epoch_reclamation::collect();
+    node::dbg_get_total_refs() = 0;
+    {
+        concurrent_hash_trie<std::string> ct;
+        for( int i = 0; i < 100; ++i )
+            ct.insert( std::to_string( i ) );
+        auto snapshot = ct.snapshot();
+        ct.erase( "1" );
+        snapshot.insert( "100" );
+        CHECK( snapshot.size() == 101 );
+    }
+    CHECK( epoch_reclamation::collect() );
+    CHECK(node::dbg_get_total_refs() == 0 );
+}
+
+TEST_CASE( "change feed ref counts" ) {
+    using namespace hamt;
+
+    node::dbg_get_total_refs() = 0;
+    {
+        shared_hash_trie<int> sh;
+        {
+            change_feed<int> feed( sh, 4 );
+            auto subscriber = feed.subscribe();
+            for( int i = 0; i < 10; ++i )
+                sh.update_with( [i]( hash_trie<int>& h ) { h.insert( i * 100 ); } );
+
+            // The feed holds on to the last four roots. Catching up, the subscriber shares the latest
+            auto held = node::dbg_get_total_refs().load();
+            CHECK( subscriber.next( []( int ) {}, []( int ) {} ) == 10 );
+            CHECK( node::dbg_get_total_refs() == held + 1 );
+        }
+        CHECK( sh.get().size() == 10 );
+        sh.update_with( []( hash_trie<int>& h ) { h.clear(); } );
+        // (just the new root - committed, even an empty trie needs one of its own to carry its version)
+        CHECK( node::dbg_get_total_refs() == 1 );
+    }
+    CHECK( node::dbg_get_total_refs() == 0 );
+}
+
+TEST_CASE( "trie group ref counts" ) {
+    using namespace hamt;
+
+    node::dbg_get_total_refs() = 0;
+    {
+        shared_trie_group<int, int> group; // (empty tries need no nodes - just the group's root)
+        CHECK( node::dbg_get_total_refs() == 1 );
+
+        group.update_with( []( hash_trie<int>& a, hash_trie<int>& b ) {
+            a.insert( 1 );
+            b.insert( 2 );
+        } );
+        // A new group root, and a root for each trie
+        CHECK( node::dbg_get_total_refs() == 3 );
+        {
+            auto trans = group.start_transaction();
+            trans.get<0>().insert( 3 );
+            CHECK( group.get<0>().size() == 1 );
+        }
+        CHECK( node::dbg_get_total_refs() == 3 );
+    }
+    CHECK( node::dbg_get_total_refs() == 0 );
+}
+
+TEST_CASE( "erase ref counts" ) {
+    using namespace hamt;
+
     node::dbg_get_total_refs() = 0;
     {
         hash_trie<int> h;
 
         h.insert(0b01000'00010'00001);
-        h.insert(0b00100'00010'00001); // differs only in third hash chunk
+        h.insert(0b00100'00010'00001);
+        h.insert(0b00000'00011'00001);
+
+        hash_trie<int> snapshot = h;
+
+        CHECK( h.erase(0b00000'00011'00001) );
+        CHECK( h.erase(0b01000'00010'00001) );
+        CHECK_FALSE( h.erase(0b01000'00010'00001) );
+        CHECK( h.size() == 1 );
+        CHECK( snapshot.size() == 3 );
     }
     CHECK(node::dbg_get_total_refs() == 0 );
 }
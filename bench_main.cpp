@@ -16,13 +16,13 @@ std::set<int> set_ints;
 std::unordered_set<std::string> unordered_set_strings;
 std::unordered_set<int> unordered_set_ints;
 
-template<typename Container, typename Iterator>
-bool isEnd( Iterator const& it, Container const& container ) {
-    return it == container.end();
+template<typename Container, typename T>
+bool contains( Container const& container, T const& item ) {
+    return container.find( item ) != container.end();
 }
-template<typename T, typename Iterator>
-bool isEnd( Iterator const& it, hamt::hash_trie<T> const& ) {
-    return !it.leaf();
+template<typename T, typename U>
+bool contains( hamt::hash_trie<T> const& container, U const& item ) {
+    return container.contains( item );
 }
 
 
@@ -96,7 +96,7 @@ void testFind( Src const& src, Dest& dest ) {
 
     for( int j = 0; j < iterations; ++j ) {
         for (auto const &item : src)
-            count += isEnd(dest.find(item), dest) ? 0 : 1;
+            count += contains(dest, item) ? 1 : 0;
     }
 
     if( count < 0 )
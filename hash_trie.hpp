@@ -13,10 +13,29 @@
 #ifndef HASH_TRIE_HPP_INCLUDED
 #define HASH_TRIE_HPP_INCLUDED
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <memory>
 #include <functional>
+#include <future>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // For debugging purposes #define one of the following before #including this header
@@ -37,11 +56,22 @@
 #include <iomanip>
 #endif
 
+// co_await support for async_committer, where the compiler has coroutines
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define HAMT_HAS_COROUTINES
+#include <coroutine>
+#endif
+
 
 // Forward refs
 namespace hamt {
     template<typename T> class branch_node;
     template<typename T> class leaf_node;
+    template<typename T> class hash_trie;
+    namespace detail {
+        template<typename T> class trie_subtracter;
+        template<typename T> class trie_merger;
+    }
 }
 
 // Default deleters (impls later)
@@ -69,6 +99,13 @@ namespace hamt {
         constexpr size_t maxDepth = (sizeof(size_t)*8)/bitsPerChunk;
         constexpr size_t chunkMask = (1<<bitsPerChunk)-1;
 
+        // Level compression: a "wide" branch is indexed by two chunks at once, through a
+        // dense array. Compaction only creates one once at least wideThreshold of its slots
+        // would be used, and it is split again when fewer than narrowThreshold are
+        constexpr size_t wideSlots = size_t(1) << (2*bitsPerChunk);
+        constexpr size_t wideThreshold = wideSlots*3/4;
+        constexpr size_t narrowThreshold = wideSlots/2;
+
 
         // adapted from `http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel`
         // - could be substituted for an assembler instruction if available?
@@ -91,10 +128,84 @@ namespace hamt {
             return x;
         }
 
+        // Mask for the lowest `chunks` hash chunks - i.e. the bits covered by a compressed prefix
+        inline auto prefix_mask( size_t chunks ) -> size_t {
+            return chunks*bitsPerChunk >= sizeof(size_t)*8
+                ? ~size_t(0)
+                : (size_t(1) << (chunks*bitsPerChunk))-1;
+        }
+
+        // The number of leading (lowest) chunks that two (equally shifted) hashes have in common
+        inline auto common_chunks( size_t hash1, size_t hash2 ) -> size_t {
+            auto diff = hash1 ^ hash2;
+            if( diff == 0 )
+                return maxDepth+1;
+            return static_cast<size_t>( __builtin_ctzll( diff ) ) / bitsPerChunk;
+        }
+
+        // A small digest of a hash, that a branch keeps for each of its leaf children, so most
+        // lookups that miss can be rejected without touching the leaf itself.
+        // Never zero, as zero marks a child that is not a leaf. A multiplicative hash is used so
+        // that the fingerprint depends on all the bits, including those not yet consumed
+        inline auto fingerprint( size_t hash ) -> uint16_t {
+            auto fingerprint = static_cast<uint16_t>( ( hash * UINT64_C(0x9e3779b97f4a7c15) ) >> 48 );
+            return fingerprint != 0 ? fingerprint : 1;
+        }
+
+        // The last chunk of a hash only has the bits that are left over, so is narrower than the rest
+        constexpr size_t finalChunkShift = maxDepth*bitsPerChunk;
+        constexpr size_t finalChunkBits = sizeof(size_t)*8 - finalChunkShift;
+
+        // Whether two hashes can only differ in their final chunk
+        inline auto differ_only_in_final_chunk( size_t hash1, size_t hash2 ) -> bool {
+            return ( ( hash1 ^ hash2 ) & prefix_mask( maxDepth ) ) == 0;
+        }
+
+        // How values are hashed. Integral values are stored inline, in place of a leaf_node,
+        // so their hash must be reversible. Rather than mixing the bits (which would scatter dense
+        // ranges), the value is rotated so that its lowest bits form the final chunk of the hash -
+        // consecutive values then only differ in that chunk, and can share a bitmap_node
+        template<typename T, bool = std::is_integral<T>::value && !std::is_same<T, bool>::value && sizeof(T) <= sizeof(size_t)>
+        struct value_hashing {
+            static constexpr bool storesInline = false;
+
+            static auto hash( T const& value ) -> size_t {
+                return std::hash<T>()( value );
+            }
+        };
+
+        template<typename T>
+        struct value_hashing<T, true> {
+            static constexpr bool storesInline = true;
+
+            static auto hash( T value ) -> size_t {
+                auto bits = static_cast<size_t>( static_cast<std::make_unsigned_t<T>>( value ) );
+                return ( bits >> finalChunkBits ) | ( bits << finalChunkShift );
+            }
+            static auto value( size_t hash ) -> T {
+                auto bits = ( hash << finalChunkBits ) | ( hash >> finalChunkShift );
+                return static_cast<T>( static_cast<std::make_unsigned_t<T>>( bits ) );
+            }
+        };
+
+        template<typename T>
+        auto hash_of( T const& value ) -> size_t {
+            return value_hashing<T>::hash( value );
+        }
+
+        // The type that a value can be looked up by. Strings can be looked up by a std::string_view
+        // (which hashes the same), without materialising a std::string
+        template<typename T>
+        struct lookup_key { using type = T; };
+
+        template<>
+        struct lookup_key<std::string> { using type = std::string_view; };
+
         struct chunked_hash {
             size_t hash;
             size_t shiftedHash;
             size_t chunk;
+            size_t depth = 0; // number of chunks consumed so far
 
             explicit chunked_hash( size_t hash )
             :   hash( hash ),
@@ -105,18 +216,28 @@ namespace hamt {
             chunked_hash& operator ++() {
                 shiftedHash >>= bitsPerChunk;
                 chunk = shiftedHash & chunkMask;
+                ++depth;
                 return *this;
             }
-            chunked_hash& operator += ( int chunks ) {
-                shiftedHash >>= (bitsPerChunk*chunks);
+            chunked_hash& operator += ( size_t chunks ) {
+                // (shifting by the full width of the hash is undefined)
+                shiftedHash = chunks*bitsPerChunk < sizeof(size_t)*8
+                    ? shiftedHash >> (bitsPerChunk*chunks)
+                    : 0;
                 chunk = shiftedHash & chunkMask;
+                depth += chunks;
                 return *this;
             }
-            chunked_hash operator + ( int chunks ) {
+            chunked_hash operator + ( size_t chunks ) const {
                 chunked_hash newChunkedHash( *this );
                 newChunkedHash += chunks;
                 return newChunkedHash;
             }
+
+            // Another hash, consumed to the same depth as this one
+            auto rebased( size_t otherHash ) const -> chunked_hash {
+                return chunked_hash( otherHash ) + depth;
+            }
         };
 
     } // namespace detail
@@ -140,7 +261,7 @@ namespace hamt {
         explicit sparse_index( size_t value ) : m_value( value )  {}
 
         auto value() const { return m_value; }
-        auto bit_position() const { return 1 << m_value; }
+        auto bit_position() const { return size_t(1) << m_value; }
 
         auto toCompact( size_t bitmap ) const {
             auto lowMask = bit_position()-1;
@@ -148,12 +269,26 @@ namespace hamt {
         }
     };
 
-    enum class node_type { branch, leaf };
+    // "Strong typedef" for the hash of a value that is stored directly in a branch's child
+    // slot, rather than in a leaf_node (see detail::value_hashing)
+    class inline_value {
+        size_t m_hash;
+    public:
+        explicit inline_value( size_t hash ) : m_hash( hash ) {}
+
+        auto hash() const { return m_hash; }
+    };
+
+    enum class node_type { branch, leaf, bitmap, group };
+
+    // What a child slot of a branch holds
+    enum class child_kind { none, branch, leaf, inline_value, bitmap };
 
     class node {
     public:
         mutable std::atomic<size_t> m_refCount { 1 };
         node_type m_type;
+        bool m_immortal = false; // statically allocated, so never ref counted (or destroyed)
 
         node() = delete;
         node( node const& ) = delete;
@@ -163,8 +298,8 @@ namespace hamt {
 
     public:
 #ifdef HAMT_DEBUG_RC
-        static auto dbg_get_total_refs() -> size_t& {
-            static size_t s_dbgTotalRefs = 0;
+        static auto dbg_get_total_refs() -> std::atomic<size_t>& { // (atomic, as shared tries are used across threads)
+            static std::atomic<size_t> s_dbgTotalRefs { 0 };
             return s_dbgTotalRefs;
         }
 #endif
@@ -207,6 +342,8 @@ namespace hamt {
             switch( m_type ) {
                 case node_type::branch: return "branch";
                 case node_type::leaf: return "leaf";
+                case node_type::bitmap: return "bitmap";
+                case node_type::group: return "group";
             }
         }
 
@@ -231,10 +368,169 @@ namespace hamt {
         explicit node( node_type type ) : m_type( type ) {}
         ~node() = default;
 #endif
+        struct immortal_tag {};
+        node( node_type type, immortal_tag ) : m_type( type ), m_immortal( true ) {}
     };
 
 
+    // How the last reference to a node being released frees it. By default that happens there and
+    // then - and for a branch, that releases its children, and so on, so dropping the last reference
+    // to a large trie can take a while, on whichever thread happened to drop it. With deferred
+    // release, nodes are queued instead, to be freed by drain_releases() (e.g. a bounded amount at
+    // a time, from an event loop) or a background_reclaimer. Only freeing a node releases its
+    // children, so they are queued in turn, and no one call does more than it is asked to.
+    // Nodes queued while deferred still need draining after switching back to immediate - though
+    // any still queued at exit are freed then
+    enum class release_mode { immediate, deferred };
+
+    namespace detail {
+        inline auto deferred_release() -> std::atomic<bool>& {
+            static std::atomic<bool> s_deferred { false };
+            return s_deferred;
+        }
+
+        // The drain() of each type of deferred_releases that has been used.
+        // This is created before any of the queues, so is destroyed after them - but they are
+        // never destroyed, so it can still drain them all at exit
+        class release_queues {
+            std::mutex m_mutex;
+            std::vector<size_t(*)( size_t )> m_drains;
+
+            ~release_queues() {
+                // (from now on nodes are freed as they are released, rather than queued)
+                deferred_release().store( false, std::memory_order_relaxed );
+                for( auto drain : m_drains )
+                    drain( std::numeric_limits<size_t>::max() );
+            }
+
+        public:
+            static auto instance() -> release_queues& {
+                static release_queues s_instance;
+                return s_instance;
+            }
+
+            void add( size_t(*drain)( size_t ) ) {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                m_drains.push_back( drain );
+            }
+
+            auto drains() -> std::vector<size_t(*)( size_t )> {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                return m_drains;
+            }
+        };
+
+        // A lock-free stack of the nodes of one type released while release is deferred. A node's
+        // ref count isn't needed once it has reached zero, so it holds the link to the next one
+        template<typename NodeT>
+        class deferred_releases {
+            std::atomic<NodeT const*> m_head { nullptr };
+            std::mutex m_drainMutex;
+            NodeT const* m_draining = nullptr; // taken from m_head, but not yet freed (guarded by m_drainMutex)
+
+            static void set_next( NodeT const* p, NodeT const* next ) {
+                p->m_refCount.store( reinterpret_cast<size_t>( next ), std::memory_order_relaxed ); // NOLINT
+            }
+            static auto next_of( NodeT const* p ) -> NodeT const* {
+                return reinterpret_cast<NodeT const*>( p->m_refCount.load( std::memory_order_relaxed ) ); // NOLINT
+            }
+
+            deferred_releases() {
+                release_queues::instance().add( []( size_t maxNodes ) { return instance().drain( maxNodes ); } );
+            }
+
+        public:
+            // Never destroyed, as freeing the nodes in one queue releases nodes of other types,
+            // which may be pushed onto their queues while statics are being destroyed at exit
+            static auto instance() -> deferred_releases& {
+                static auto s_instance = new deferred_releases();
+                return *s_instance;
+            }
+
+            void push( NodeT const* p ) {
+                auto head = m_head.load( std::memory_order_relaxed );
+                do {
+                    set_next( p, head );
+                } while( !m_head.compare_exchange_weak( head, p, std::memory_order_release, std::memory_order_relaxed ) );
+            }
+
+            // Frees up to maxNodes nodes, and returns how many were freed. If another thread
+            // is already draining this queue, leaves it to that thread
+            auto drain( size_t maxNodes ) -> size_t {
+                std::unique_lock<std::mutex> lock( m_drainMutex, std::try_to_lock );
+                if( !lock.owns_lock() )
+                    return 0;
+                size_t freed = 0;
+                for( ; freed < maxNodes; ++freed ) {
+                    if( !m_draining ) {
+                        m_draining = m_head.exchange( nullptr, std::memory_order_acquire );
+                        if( !m_draining )
+                            break;
+                    }
+                    auto p = m_draining;
+                    m_draining = next_of( p );
+                    std::default_delete<NodeT>()( const_cast<NodeT*>( p ) );
+                }
+                return freed;
+            }
+        };
+    }
+
+    inline void set_release_mode( release_mode mode ) {
+        detail::deferred_release().store( mode == release_mode::deferred, std::memory_order_relaxed );
+    }
+
+    // Frees up to maxNodes of the nodes queued by deferred release, and returns how many were freed
+    inline auto drain_releases( size_t maxNodes = std::numeric_limits<size_t>::max() ) -> size_t {
+        size_t freed = 0;
+        while( freed < maxNodes ) {
+            // (freeing a node of one type can queue nodes of another, so keep going until nothing is freed)
+            auto freedThisPass = freed;
+            for( auto drain : detail::release_queues::instance().drains() )
+                freed += drain( maxNodes - freed );
+            if( freed == freedThisPass )
+                break;
+        }
+        return freed;
+    }
+
+    // Drains deferred releases on a thread of its own, a batch at a time, for as long as it lives
+    class background_reclaimer {
+        std::mutex m_mutex;
+        std::condition_variable m_stop;
+        bool m_stopping = false;
+        std::thread m_thread;
+
+    public:
+        explicit background_reclaimer( std::chrono::milliseconds interval = std::chrono::milliseconds( 10 ),
+                                       size_t batchSize = 4096 )
+        :   m_thread( [this, interval, batchSize] {
+                std::unique_lock<std::mutex> lock( m_mutex );
+                while( !m_stopping ) {
+                    lock.unlock();
+                    // (while there is a backlog, carry straight on with the next batch)
+                    while( drain_releases( batchSize ) == batchSize ) {}
+                    lock.lock();
+                    m_stop.wait_for( lock, interval, [this] { return m_stopping; } );
+                }
+            } )
+        {}
+        background_reclaimer( background_reclaimer const& ) = delete;
+        background_reclaimer& operator = ( background_reclaimer const& ) = delete;
+
+        ~background_reclaimer() {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                m_stopping = true;
+            }
+            m_stop.notify_one();
+            m_thread.join();
+        }
+    };
+
     inline void addref(node const *p) {
+        if( p->m_immortal )
+            return;
 
         std::atomic_fetch_add_explicit (&p->m_refCount, size_t(1), std::memory_order_relaxed);
         p->dbg_addref("++", p->m_refCount.load( std::memory_order_relaxed ) );
@@ -242,11 +538,16 @@ namespace hamt {
 
     template<typename NodeT>
     inline void release( NodeT const* p ) {
+        if( p->m_immortal )
+            return;
         p->dbg_release( p->m_refCount.load( std::memory_order_relaxed ) );
 
         if( std::atomic_fetch_sub_explicit (&p->m_refCount, size_t(1), std::memory_order_release) == 1 ) {
             std::atomic_thread_fence( std::memory_order_acquire );
-            std::default_delete<NodeT>()( const_cast<NodeT *>( p ) );
+            if( detail::deferred_release().load( std::memory_order_relaxed ) )
+                detail::deferred_releases<NodeT>::instance().push( p );
+            else
+                std::default_delete<NodeT>()( const_cast<NodeT *>( p ) );
         }
     }
 
@@ -274,19 +575,26 @@ namespace hamt {
         // Calculates the raw storage size for a leaf type that
         // contains size elements in the array
         static constexpr auto storage_size(size_t size) {
-            return sizeof(leaf_node) + sizeof(T*[size-1]);
+            return sizeof(leaf_node) + sizeof(T)*(size-1);
         }
 
         // Creates a new leaf_node type with enough additional storage for
-        // size items - but does not populate the array
+        // size items - but does not populate the array. Its size only counts the values
+        // appended since, so if copying one throws just those are destroyed (and the storage freed)
         static auto create_unpopulated( size_t size, size_t hash ) {
             assert( size >=1 );
             auto temp = std::make_unique<unsigned char[]>(storage_size(size) );
-            auto leaf_ptr = new(temp.get()) leaf_node( size, hash );
+            auto leaf_ptr = new(temp.get()) leaf_node( 0, hash );
             temp.release();
             return std::unique_ptr<leaf_node>( leaf_ptr );
         }
 
+        template<typename U>
+        void append( U &&value ) {
+            new (&m_values[m_size]) T( std::forward<U>( value ) );
+            ++m_size;
+        }
+
     public:
 
         auto hash() const { return m_hash; }
@@ -295,7 +603,7 @@ namespace hamt {
         template<typename U>
         static auto create( U &&value, size_t hash ) -> std::unique_ptr<leaf_node> {
             auto leaf = create_unpopulated(1, hash);
-            new (&leaf->m_values[0]) T( std::forward<U>( value ) );
+            leaf->append( std::forward<U>( value ) );
             return leaf;
         }
 
@@ -303,8 +611,20 @@ namespace hamt {
         auto with_appended_value(U &&newValue) const {
             auto newLeaf = create_unpopulated(m_size + 1, m_hash);
             for( size_t i=0; i < m_size; ++i )
-                new (&newLeaf->m_values[i]) T( m_values[i] );
-            new (&newLeaf->m_values[m_size]) T( std::forward<U>( newValue ) );
+                newLeaf->append( m_values[i] );
+            newLeaf->append( std::forward<U>( newValue ) );
+            return newLeaf;
+        }
+
+        auto without_value(T const& value) const {
+            assert( m_size > 1 );
+            auto newLeaf = create_unpopulated(m_size - 1, m_hash);
+            for( size_t i=0; i < m_size; ++i ) {
+                if( !( m_values[i] == value ) ) {
+                    assert( newLeaf->m_size < m_size-1 );
+                    newLeaf->append( m_values[i] );
+                }
+            }
             return newLeaf;
         }
 
@@ -319,85 +639,537 @@ namespace hamt {
             assert( index < m_size );
             return m_values[index];
         }
+
+        // (not counting anything the values themselves allocate)
+        auto allocation_size() const -> size_t { return storage_size( m_size ); }
+    };
+
+
+    // Strings are stored in the leaf's own storage, rather than each in a std::string (which, for
+    // all but the shortest, would be a second allocation). Each is a length followed by its chars,
+    // and they are accessed as std::string_views
+    template<>
+    class leaf_node<std::string> : public node { // NOLINT
+        friend class std::default_delete<leaf_node>;
+
+        using length_type = uint32_t;
+
+        size_t m_size;
+        size_t m_hash;
+        size_t m_bytes; // the total length of m_chars
+        union {
+            char m_chars[1];
+        };
+
+        leaf_node( size_t size, size_t hash, size_t bytes )
+        :   node( node_type::leaf ),
+            m_size( size ),
+            m_hash( hash ),
+            m_bytes( bytes )
+        {}
+
+        // Calculates the raw storage size for a leaf type that
+        // stores bytes of (length prefixed) strings
+        static constexpr auto storage_size(size_t bytes) {
+            return sizeof(leaf_node) + bytes;
+        }
+
+        static constexpr auto entry_size( std::string_view value ) {
+            return sizeof(length_type) + value.size();
+        }
+
+        // Creates a new leaf_node type with enough additional storage for
+        // bytes of strings - but does not populate it
+        static auto create_unpopulated( size_t size, size_t hash, size_t bytes ) {
+            assert( size >=1 );
+            auto temp = std::make_unique<unsigned char[]>(storage_size(bytes) );
+            auto leaf_ptr = new(temp.get()) leaf_node( size, hash, bytes );
+            temp.release();
+            return std::unique_ptr<leaf_node>( leaf_ptr );
+        }
+
+        // Writes value at offset, returning the offset after it
+        auto write_at( size_t offset, std::string_view value ) -> size_t {
+            assert( value.size() <= std::numeric_limits<length_type>::max() );
+            auto length = static_cast<length_type>( value.size() );
+            std::memcpy( m_chars + offset, &length, sizeof(length) );
+            std::memcpy( m_chars + offset + sizeof(length), value.data(), value.size() );
+            return offset + entry_size( value );
+        }
+        auto read_at( size_t offset ) const -> std::string_view {
+            length_type length;
+            std::memcpy( &length, m_chars + offset, sizeof(length) );
+            return std::string_view( m_chars + offset + sizeof(length), length );
+        }
+
+    public:
+
+        auto hash() const { return m_hash; }
+        auto size() const { return m_size; }
+
+        static auto create( std::string_view value, size_t hash ) -> std::unique_ptr<leaf_node> {
+            auto leaf = create_unpopulated(1, hash, entry_size( value ));
+            leaf->write_at( 0, value );
+            return leaf;
+        }
+
+        auto with_appended_value(std::string_view newValue) const {
+            auto newLeaf = create_unpopulated(m_size + 1, m_hash, m_bytes + entry_size( newValue ));
+            std::memcpy( newLeaf->m_chars, m_chars, m_bytes );
+            newLeaf->write_at( m_bytes, newValue );
+            return newLeaf;
+        }
+
+        auto without_value(std::string_view value) const {
+            assert( m_size > 1 && find( value ) );
+            auto newLeaf = create_unpopulated(m_size - 1, m_hash, m_bytes - entry_size( value ));
+            size_t newOffset = 0;
+            for( size_t offset = 0; offset < m_bytes; offset += entry_size( read_at( offset ) ) ) {
+                auto existing = read_at( offset );
+                if( existing != value )
+                    newOffset = newLeaf->write_at( newOffset, existing );
+            }
+            return newLeaf;
+        }
+
+        // Returns the stored chars of the matching string, or nullptr if not found
+        auto find( std::string_view value ) const -> char const* {
+            for( size_t offset = 0; offset < m_bytes; offset += entry_size( read_at( offset ) ) ) {
+                auto existing = read_at( offset );
+                if( existing == value )
+                    return existing.data();
+            }
+            return nullptr;
+        }
+
+        auto get_at(size_t index) const -> std::string_view {
+            assert( index < m_size );
+            size_t offset = 0;
+            for( ; index > 0; --index )
+                offset += entry_size( read_at( offset ) );
+            return read_at( offset );
+        }
+
+        auto allocation_size() const -> size_t { return storage_size( m_bytes ); }
+    };
+
+
+    // Holds the (inline) values whose hashes only differ in their final chunk, as a bitmap
+    // of which final chunks are present - so dense ranges of integers need no node per value.
+    // It always holds at least two values
+    class bitmap_node : public node {
+        size_t m_base; // the hash that all the values share, with the final chunk clear
+        uint32_t m_bitmap;
+
+        bitmap_node( size_t base, uint32_t bitmap )
+        :   node( node_type::bitmap ),
+            m_base( base ),
+            m_bitmap( bitmap )
+        {}
+
+        static auto bit( size_t hash ) -> uint32_t {
+            return uint32_t(1) << ( hash >> detail::finalChunkShift );
+        }
+
+    public:
+        static auto create( size_t hash1, size_t hash2 ) -> std::unique_ptr<bitmap_node> {
+            assert( hash1 != hash2 && detail::differ_only_in_final_chunk( hash1, hash2 ) );
+            return std::unique_ptr<bitmap_node>
+                    ( new bitmap_node( hash1 & detail::prefix_mask( detail::maxDepth ), bit( hash1 ) | bit( hash2 ) ) );
+        }
+
+        auto with_hash( size_t hash ) const -> std::unique_ptr<bitmap_node> {
+            assert( matches( hash ) && !contains( hash ) );
+            return std::unique_ptr<bitmap_node>( new bitmap_node( m_base, m_bitmap | bit( hash ) ) );
+        }
+
+        // Only valid if at least two values would remain
+        auto without_hash( size_t hash ) const -> std::unique_ptr<bitmap_node> {
+            assert( contains( hash ) && size() > 2 );
+            return std::unique_ptr<bitmap_node>( new bitmap_node( m_base, m_bitmap & ~bit( hash ) ) );
+        }
+
+        auto base() const { return m_base; }
+        auto size() const -> size_t { return detail::count_set_bits( m_bitmap ); }
+        auto allocation_size() const -> size_t { return sizeof(bitmap_node); }
+
+        // Whether a value with this hash would belong here
+        auto matches( size_t hash ) const -> bool {
+            return detail::differ_only_in_final_chunk( hash, m_base );
+        }
+        auto contains( size_t hash ) const -> bool {
+            return matches( hash ) && ( m_bitmap & bit( hash ) ) != 0;
+        }
+
+        // The hash of the index'th value, in order of their final chunks
+        auto hash_at( size_t index ) const -> size_t {
+            assert( index < size() );
+            auto bitmap = m_bitmap;
+            for( ; index > 0; --index )
+                bitmap &= bitmap-1;
+            return m_base | ( static_cast<size_t>( __builtin_ctz( bitmap ) ) << detail::finalChunkShift );
+        }
     };
 
 
     template<typename T>
     class branch_node : public node { // NOLINT
         friend class std::default_delete<branch_node>;
+        friend class hash_trie<T>;
+        template<typename, typename> friend class shared_hash_trie;
+        friend class detail::trie_subtracter<T>;
+        friend class detail::trie_merger<T>;
 
-        size_t m_size;
+        // Whether values are held in the child slots themselves, rather than in leaf_nodes
+        static constexpr bool storesInline = detail::value_hashing<T>::storesInline;
+
+        uint32_t m_size;
+        uint32_t m_valuemap = 0; // set bits indicate the child at that *compact* index is a value (unused if wide)
         size_t m_bitmap; // set bits indicate the indexed element is a branch or leaf value
 
+        // Path compression: rather than a chain of single-child branches, a branch may
+        // record the hash chunks that all of its descendants share (below the chunk that
+        // indexed it in its parent). m_skip is the number of such chunks, m_prefix their bits
+        size_t m_prefix = 0;
+        uint32_t m_skip = 0;
+
+        // Level compression: a wide branch has no bitmap. Instead m_children is a dense array
+        // of detail::wideSlots (null where unset), indexed by the next two chunks of the hash
+        bool m_wide = false;
+
+        // The number of values in the whole trie - only maintained for a root, by its hash_trie
+        size_t m_count = 0;
+
+        // The version of the shared_hash_trie that this became the root of - only maintained for
+        // a root committed to a shared_hash_trie, which sets it before the commit publishes it
+        uint64_t m_version = 0;
+
         union {
             node const *m_children[1];
         };
+        // m_children is followed by an array of detail::fingerprints, one per child slot
+        // (zero for a node that is not a value, or an unset slot).
+        // A value is either a leaf_node or, if storesInline, the value's hash itself
 
 
         explicit branch_node( size_t size, size_t bitmap ) // NOLINT
         :   node( node_type::branch ),
-            m_size( size ),
+            m_size( static_cast<uint32_t>( size ) ),
             m_bitmap( bitmap )
         {}
+        explicit branch_node( immortal_tag tag )
+        :   node( node_type::branch, tag ),
+            m_size( 0 ),
+            m_bitmap( 0 )
+        {}
+
+        void set_prefix( size_t prefix, size_t skip ) {
+            assert( skip <= detail::maxDepth );
+            m_prefix = prefix & detail::prefix_mask( skip );
+            m_skip = static_cast<uint32_t>( skip );
+        }
 
         ~branch_node() {
-            auto len = size();
+            auto len = capacity();
             for( size_t i = 0; i < len; ++i ) {
                 auto node = m_children[i];
-                if( node->m_type == node_type::branch )
-                    release( static_cast<branch_node<T> const*>( node ) );
-                else
-                    release( static_cast<leaf_node<T> const*>( node ) );
+                if( !node || holds_inline_value( i ) )
+                    continue;
+                switch( node->m_type ) {
+                    case node_type::branch: release( static_cast<branch_node<T> const*>( node ) ); break;
+                    case node_type::leaf: release( static_cast<leaf_node<T> const*>( node ) ); break;
+                    case node_type::bitmap: release( static_cast<bitmap_node const*>( node ) ); break;
+                    case node_type::group: assert( false ); break; // (never a child)
+                }
             }
         }
 
         // Calculates the raw storage size for a node type that
-        // contains size elements in the array
+        // contains size elements in the array (and their fingerprints)
         static constexpr auto storage_size(size_t size) {
-            return sizeof(branch_node) + sizeof(node*)*(size-1);
+            return sizeof(branch_node) + sizeof(node*)*(size-1) + sizeof(uint16_t)*size;
+        }
+
+        auto fingerprints() -> uint16_t* {
+            return reinterpret_cast<uint16_t*>( m_children + capacity() ); // NOLINT
+        }
+        auto fingerprints() const -> uint16_t const* {
+            return reinterpret_cast<uint16_t const*>( m_children + capacity() ); // NOLINT
+        }
+
+        auto holds_inline_value( size_t index ) const -> bool {
+            return storesInline && fingerprints()[index] != 0;
+        }
+
+        // Whether a slot is populated (an inline value may be all zero bits)
+        auto occupied( size_t index ) const -> bool {
+            return m_children[index] || fingerprints()[index] != 0;
+        }
+
+        void set_fingerprint( size_t index, uint16_t fingerprint ) {
+            fingerprints()[index] = fingerprint;
+            if( !m_wide ) {
+                auto bit = uint32_t(1) << index;
+                m_valuemap = fingerprint != 0 ? ( m_valuemap | bit ) : ( m_valuemap & ~bit );
+            }
+        }
+
+        // Takes ownership of child (which may be null, in a wide branch)
+        void set_child( size_t index, node const* child ) {
+            m_children[index] = child;
+            set_fingerprint( index, child && child->m_type == node_type::leaf
+                ? detail::fingerprint( static_cast<leaf_node<T> const*>( child )->hash() )
+                : 0 );
+        }
+        void set_child( size_t index, inline_value value ) {
+            assert( storesInline );
+            m_children[index] = reinterpret_cast<node const*>( value.hash() ); // NOLINT
+            set_fingerprint( index, detail::fingerprint( value.hash() ) );
+        }
+
+        static auto is_present( node const* child ) -> bool { return child != nullptr; }
+        static auto is_present( inline_value ) -> bool { return true; }
+
+        // Shares a child of another branch (so its fingerprint does not need recalculating)
+        void share_child( size_t index, branch_node const& other, size_t otherIndex ) {
+            auto sharedNode = m_children[index] = other.m_children[otherIndex];
+            set_fingerprint( index, other.fingerprints()[otherIndex] );
+            if( !other.holds_inline_value( otherIndex ) )
+                addref(sharedNode);
         }
 
         // Creates a new branch_node type with enough additional storage for
         // size items - but does not populate the array
         static auto create_unpopulated( size_t size, size_t bitmap ) {
             assert( size <= 32 );
-            auto temp = std::make_unique<unsigned char[]>(storage_size(size) );
+            // (an empty branch still has storage for one child, so its fingerprints are in bounds)
+            auto temp = std::make_unique<unsigned char[]>(storage_size( std::max( size, size_t(1) ) ) );
 
             auto node_ptr = new(temp.get()) branch_node( size, bitmap );
             temp.release();
             return std::unique_ptr<branch_node>( node_ptr );
         }
 
-    public:
-        static auto create_empty() -> std::unique_ptr<branch_node> {
-            auto node = create_unpopulated( 1, 0 );
-            node->m_size = 0;
+        // As create_unpopulated, but for a wide branch - all slots are initially null
+        static auto create_wide_unpopulated( size_t size ) {
+            assert( size <= detail::wideSlots );
+            auto temp = std::make_unique<unsigned char[]>(storage_size(detail::wideSlots) );
+
+            auto node_ptr = new(temp.get()) branch_node( size, 0 );
+            temp.release();
+            node_ptr->m_wide = true;
+            std::fill( node_ptr->m_children, node_ptr->m_children + detail::wideSlots, nullptr );
+            std::fill( node_ptr->fingerprints(), node_ptr->fingerprints() + detail::wideSlots, 0 );
+            return std::unique_ptr<branch_node>( node_ptr );
+        }
+
+        // Copies a wide branch, sharing all its children, except that the slot at
+        // sparseIndex is set to child (which may be null, to remove it)
+        template<typename ChildT>
+        auto wide_with(sparse_index sparseIndex, ChildT child) const -> std::unique_ptr<branch_node> {
+            assert( m_wide );
+            auto index = sparseIndex.value();
+            auto newSize = m_size - ( occupied( index ) ? 1 : 0 ) + ( is_present( child ) ? 1 : 0 );
+            auto node = create_wide_unpopulated( newSize );
+            node->set_prefix( m_prefix, m_skip );
+            for( size_t i = 0; i < detail::wideSlots; ++i ) {
+                if( i != index && occupied( i ) )
+                    node->share_child( i, *this, i );
+            }
+            node->set_child( index, child );
+            return node;
+        }
+
+        // Splits a wide branch back into a regular branch on the first of its chunks, with
+        // regular branches below that for the second where more than one slot is used.
+        // The child at excludedIndex is left out
+        auto narrowed( size_t excludedIndex ) const -> std::unique_ptr<branch_node> {
+            assert( m_wide );
+            size_t bitmap = 0;
+            for( size_t index = 0; index < detail::wideSlots; ++index ) {
+                if( index != excludedIndex && occupied( index ) )
+                    bitmap |= size_t(1) << ( index & detail::chunkMask );
+            }
+
+            auto node = create_unpopulated( detail::count_set_bits( static_cast<uint32_t>( bitmap ) ), bitmap );
+            node->set_prefix( m_prefix, m_skip );
+
+            size_t compactIndex = 0;
+            for( size_t chunk = 0; chunk <= detail::chunkMask; ++chunk ) {
+                size_t group[1 << detail::bitsPerChunk];
+                size_t groupBitmap = 0;
+                size_t groupSize = 0;
+                size_t lastSubChunk = 0;
+                for( size_t subChunk = 0; subChunk <= detail::chunkMask; ++subChunk ) {
+                    auto index = chunk | ( subChunk << detail::bitsPerChunk );
+                    if( index != excludedIndex && occupied( index ) ) {
+                        group[groupSize++] = index;
+                        groupBitmap |= size_t(1) << subChunk;
+                        lastSubChunk = subChunk;
+                    }
+                }
+                if( groupSize == 0 )
+                    continue;
+
+                if( groupSize > 1 ) {
+                    auto groupBranch = create_unpopulated( groupSize, groupBitmap );
+                    for( size_t i = 0; i < groupSize; ++i )
+                        groupBranch->share_child( i, *this, group[i] );
+                    node->set_child( compactIndex, groupBranch.release() );
+                }
+                else if( kind_at( compact_index( group[0] ) ) != child_kind::branch ) {
+                    // A lone value (or bitmap) just moves up a level
+                    node->share_child( compactIndex, *this, group[0] );
+                }
+                else {
+                    // A lone branch takes the second chunk onto the front of its prefix
+                    auto onlyBranch = static_cast<branch_node const*>( m_children[group[0]] );
+                    node->set_child( compactIndex, onlyBranch->with_prefix
+                            ( ( onlyBranch->prefix() << detail::bitsPerChunk ) | lastSubChunk,
+                              onlyBranch->skip() + 1 ).release() );
+                }
+                ++compactIndex;
+            }
             return node;
         }
 
-        static auto create_single(sparse_index index, node const *child) -> std::unique_ptr<branch_node> {
+    public:
+        // The root of every empty trie. It is statically allocated, and never ref counted,
+        // so creating (and clearing) an empty trie needs no allocation
+        static auto empty() noexcept -> branch_node const* {
+            alignas(branch_node) static unsigned char storage[storage_size(1)];
+            static auto root = new(storage) branch_node( immortal_tag() );
+            return root;
+        }
+
+        template<typename ChildT>
+        static auto create_single(sparse_index index, ChildT child) -> std::unique_ptr<branch_node> {
             auto node = create_unpopulated( 1, static_cast<size_t>( index.bit_position() ) );
-            node->m_children[0] = child;
+            node->set_child( 0, child );
             return node;
         }
 
-        static auto create_pair(sparse_index index1, leaf_node<T> const *leaf1, sparse_index index2,
-                                leaf_node<T> const *leaf2) -> std::unique_ptr<branch_node> {
+        template<typename Child1T, typename Child2T>
+        static auto create_pair(sparse_index index1, Child1T child1, sparse_index index2,
+                                Child2T child2, size_t prefix = 0, size_t skip = 0) -> std::unique_ptr<branch_node> {
+            assert( index1.value() != index2.value() );
             auto bitmap = static_cast<size_t>( index1.bit_position() | index2.bit_position() );
             auto node = create_unpopulated( 2, bitmap );
-            auto children = &node->m_children[0];
+            node->set_prefix( prefix, skip );
             if( index1.value() >  index2.value() ) {
-                children[0] = leaf2;
-                children[1] = leaf1;
+                node->set_child( 0, child2 );
+                node->set_child( 1, child1 );
             }
             else {
-                children[0] = leaf1;
-                children[1] = leaf2;
+                node->set_child( 0, child1 );
+                node->set_child( 1, child2 );
+            }
+            return node;
+        }
+
+        // A copy of this branch, sharing all children, but with a different compressed prefix
+        auto with_prefix( size_t prefix, size_t skip ) const -> std::unique_ptr<branch_node> {
+            auto copy = transformed( []( node const* child ) { addref( child ); return child; } );
+            copy->set_prefix( prefix, skip );
+            return copy;
+        }
+
+        // A copy of this branch, where each child that is not a value is replaced with the result
+        // of transform( child ) - which must return a node the new branch can take ownership of.
+        // Values are shared as they are
+        template<typename F>
+        auto transformed( F&& transform ) const -> std::unique_ptr<branch_node> {
+            auto len = capacity();
+            auto node = m_wide
+                    ? create_wide_unpopulated( m_size )
+                    : create_unpopulated( len, m_bitmap );
+            node->set_prefix( m_prefix, m_skip );
+            for( size_t i = 0; i < len; ++i ) {
+                if( !occupied( i ) )
+                    continue;
+                if( is_value_at( compact_index( i ) ) ) {
+                    node->share_child( i, *this, i );
+                    continue;
+                }
+                auto child = m_children[i];
+                auto newChild = transform( child );
+                if( newChild == child ) {
+                    node->m_children[i] = child;
+                    node->set_fingerprint( i, fingerprints()[i] );
+                }
+                else
+                    node->set_child( i, newChild );
+            }
+            return node;
+        }
+
+        // How many slots a wide branch would use if this branch, and the branches
+        // immediately below it, were level-compressed into one. Zero if that is not possible.
+        // depth is the number of chunks already consumed by the time this branch is indexed
+        auto wide_occupancy( size_t depth ) const -> size_t {
+            if( m_wide || depth + 1 > detail::maxDepth )
+                return 0;
+            size_t occupancy = 0;
+            for( size_t i = 0; i < m_size; ++i ) {
+                auto kind = kind_at( compact_index( i ) );
+                if( kind == child_kind::bitmap && depth + 1 == detail::maxDepth )
+                    return 0; // (its values differ in the final chunk, so cannot share one slot)
+                if( kind != child_kind::branch ) {
+                    ++occupancy;
+                    continue;
+                }
+                auto childBranch = static_cast<branch_node const*>( m_children[i] );
+                if( childBranch->m_wide )
+                    return 0;
+                occupancy += childBranch->m_skip == 0 ? childBranch->size() : 1;
+            }
+            return occupancy;
+        }
+
+        // Level-compresses this branch and the (regular) branches immediately below it
+        auto widened( size_t depth ) const -> std::unique_ptr<branch_node> {
+            assert( wide_occupancy( depth ) > 0 );
+            auto node = create_wide_unpopulated( wide_occupancy( depth ) );
+            node->set_prefix( m_prefix, m_skip );
+
+            auto bitmap = m_bitmap;
+            for( size_t i = 0; i < m_size; ++i, bitmap &= bitmap-1 ) {
+                auto chunk = static_cast<size_t>( __builtin_ctzll( bitmap ) );
+                auto kind = kind_at( compact_index( i ) );
+                if( kind != child_kind::branch ) {
+                    auto hash = kind == child_kind::bitmap
+                            ? static_cast<bitmap_node const*>( m_children[i] )->base()
+                            : value_hash_at( compact_index( i ) );
+                    auto subChunk = ( hash >> ( (depth+1) * detail::bitsPerChunk ) ) & detail::chunkMask;
+                    node->share_child( chunk | ( subChunk << detail::bitsPerChunk ), *this, i );
+                    continue;
+                }
+                auto childBranch = static_cast<branch_node const*>( m_children[i] );
+                if( childBranch->m_skip == 0 ) {
+                    auto subBitmap = childBranch->m_bitmap;
+                    for( size_t j = 0; j < childBranch->m_size; ++j, subBitmap &= subBitmap-1 ) {
+                        auto subChunk = static_cast<size_t>( __builtin_ctzll( subBitmap ) );
+                        node->share_child( chunk | ( subChunk << detail::bitsPerChunk ), *childBranch, j );
+                    }
+                }
+                else {
+                    // The first chunk of the prefix becomes the second chunk of the index
+                    auto subChunk = childBranch->m_prefix & detail::chunkMask;
+                    node->set_child( chunk | ( subChunk << detail::bitsPerChunk ), childBranch->with_prefix
+                            ( childBranch->m_prefix >> detail::bitsPerChunk,
+                              childBranch->m_skip - 1 ).release() );
+                }
             }
             return node;
         }
 
-        auto with_inserted(sparse_index sparseIndex, node const *child) const -> std::unique_ptr<branch_node> {
+        template<typename ChildT>
+        auto with_inserted(sparse_index sparseIndex, ChildT child) const -> std::unique_ptr<branch_node> {
+            if( m_wide ) {
+                assert( !occupied( sparseIndex.value() ) );
+                return wide_with( sparseIndex, child );
+            }
+
             auto originalSize = size();
             auto bitmap = m_bitmap | sparseIndex.bit_position();
 
@@ -405,24 +1177,27 @@ namespace hamt {
             assert( ( m_bitmap & sparseIndex.bit_position() ) == 0 );
 
             auto node = create_unpopulated( originalSize + 1, bitmap );
+            node->set_prefix( m_prefix, m_skip );
 
             auto splitPoint = sparseIndex.toCompact( m_bitmap ).value();
 
-            for( size_t i = 0; i < splitPoint; ++i ) {
-                auto sharedNode = node->m_children[i] = m_children[i];
-                addref(sharedNode);
-            }
+            for( size_t i = 0; i < splitPoint; ++i )
+                node->share_child( i, *this, i );
 
-            node->m_children[splitPoint] = child;
+            node->set_child( splitPoint, child );
 
-            for( size_t i = splitPoint; i < originalSize; ++i ) {
-                auto sharedNode = node->m_children[i+1] = m_children[i];
-                addref(sharedNode);
-            }
+            for( size_t i = splitPoint; i < originalSize; ++i )
+                node->share_child( i+1, *this, i );
             return node;
         }
 
-        auto with_replaced(sparse_index sparseIndex, node const *child) const -> std::unique_ptr<branch_node> {
+        template<typename ChildT>
+        auto with_replaced(sparse_index sparseIndex, ChildT child) const -> std::unique_ptr<branch_node> {
+            if( m_wide ) {
+                assert( occupied( sparseIndex.value() ) );
+                return wide_with( sparseIndex, child );
+            }
+
             auto originalSize = size();
             auto bitmap = m_bitmap | sparseIndex.bit_position();
 
@@ -430,32 +1205,147 @@ namespace hamt {
             assert( ( m_bitmap & sparseIndex.bit_position() ) != 0 );
 
             auto node = create_unpopulated( originalSize, bitmap );
+            node->set_prefix( m_prefix, m_skip );
 
             auto splitPoint = sparseIndex.toCompact( m_bitmap ).value();
 
-            for( size_t i = 0; i < splitPoint; ++i ) {
-                auto sharedNode = node->m_children[i] = m_children[i];
-                addref(sharedNode);
-            }
+            for( size_t i = 0; i < splitPoint; ++i )
+                node->share_child( i, *this, i );
 
-            node->m_children[splitPoint] = child;
+            node->set_child( splitPoint, child );
 
-            for( size_t i = splitPoint+1; i < originalSize; ++i ) {
-                auto sharedNode = node->m_children[i] = m_children[i];
-                addref(sharedNode);
+            for( size_t i = splitPoint+1; i < originalSize; ++i )
+                node->share_child( i, *this, i );
+            return node;
+        }
+
+        auto with_removed(sparse_index sparseIndex) const -> std::unique_ptr<branch_node> {
+            auto originalSize = size();
+
+            if( m_wide ) {
+                assert( occupied( sparseIndex.value() ) );
+                return originalSize - 1 < detail::narrowThreshold
+                    ? narrowed( sparseIndex.value() )
+                    : wide_with( sparseIndex, static_cast<node const*>( nullptr ) );
             }
+
+            assert( ( m_bitmap & sparseIndex.bit_position() ) != 0 );
+            auto bitmap = m_bitmap & ~sparseIndex.bit_position();
+
+            auto node = create_unpopulated( originalSize > 1 ? originalSize - 1 : 1, bitmap );
+            node->m_size = static_cast<uint32_t>( originalSize - 1 );
+            node->set_prefix( m_prefix, m_skip );
+
+            auto removePoint = sparseIndex.toCompact( m_bitmap ).value();
+
+            for( size_t i = 0; i < removePoint; ++i )
+                node->share_child( i, *this, i );
+            for( size_t i = removePoint+1; i < originalSize; ++i )
+                node->share_child( i-1, *this, i );
             return node;
         }
 
-        auto size() const {
-            assert( m_size == detail::count_set_bits( static_cast<uint32_t>( m_bitmap ) ) );
+        auto size() const -> size_t {
+            assert( m_wide || m_size == detail::count_set_bits( static_cast<uint32_t>( m_bitmap ) ) );
             return m_size;
         }
 
+        // The number of child slots, whether populated or not: only differs from size() if wide
+        auto capacity() const -> size_t {
+            return m_wide ? detail::wideSlots : m_size;
+        }
+
+        // (a branch emptied by an erase still has storage for one child)
+        auto allocation_size() const -> size_t {
+            return storage_size( std::max( capacity(), size_t(1) ) );
+        }
+
+        // The first compact index, from index onwards, that holds a child (or capacity())
+        auto next_occupied( size_t index ) const -> size_t {
+            if( m_wide ) {
+                while( index < detail::wideSlots && !occupied( index ) )
+                    ++index;
+            }
+            return index;
+        }
+
+        auto bitmap() const { return m_bitmap; }
+        auto prefix() const { return m_prefix; }
+        auto skip() const -> size_t { return m_skip; }
+        auto count() const { return m_count; }
+        auto version() const { return m_version; }
+
+        // A new branch, sharing all of this one's children (and its count)
+        auto cloned() const -> std::unique_ptr<branch_node> {
+            auto node = m_wide ? create_wide_unpopulated( m_size ) : create_unpopulated( m_size, m_bitmap );
+            node->set_prefix( m_prefix, m_skip );
+            for( size_t i = 0; i < capacity(); ++i ) {
+                if( occupied( i ) )
+                    node->share_child( i, *this, i );
+            }
+            node->m_count = m_count;
+            return node;
+        }
+        auto is_wide() const { return m_wide; }
+
+        // The number of hash chunks consumed by this branch's index
+        auto chunks() const -> size_t { return m_wide ? 2 : 1; }
+
+        // The index of the child that would hold the (appropriately consumed) hash
+        auto index_of( detail::chunked_hash const& chunkedHash ) const {
+            return sparse_index( chunkedHash.shiftedHash & detail::prefix_mask( chunks() ) );
+        }
+
+        // Checks the compressed prefix against a hash that has been consumed up to this branch
+        auto prefix_matches( detail::chunked_hash const& chunkedHash ) const -> bool {
+            return m_skip == 0 || ( chunkedHash.shiftedHash & detail::prefix_mask( m_skip ) ) == m_prefix;
+        }
+
+        // Whether there is a child at sparseIndex (for a wide branch this loads the slot itself)
+        auto has_child( sparse_index sparseIndex ) const -> bool {
+            return m_wide
+                ? occupied( sparseIndex.value() )
+                : ( m_bitmap & sparseIndex.bit_position() ) != 0;
+        }
+        auto to_compact( sparse_index sparseIndex ) const {
+            return m_wide ? compact_index( sparseIndex.value() ) : sparseIndex.toCompact( m_bitmap );
+        }
+
+        // Whether the child is a value (a leaf, or an inline value) - without needing to load the child itself
+        auto is_value_at(compact_index compactIndex) const -> bool {
+            return m_wide
+                ? fingerprints()[compactIndex.value()] != 0
+                : ( m_valuemap & ( uint32_t(1) << compactIndex.value() ) ) != 0;
+        }
+
+        auto kind_at(compact_index compactIndex) const -> child_kind {
+            if( is_value_at( compactIndex ) )
+                return storesInline ? child_kind::inline_value : child_kind::leaf;
+            return m_children[compactIndex.value()]->m_type == node_type::bitmap
+                ? child_kind::bitmap
+                : child_kind::branch;
+        }
+
+        // Zero if the child is not a value, otherwise the detail::fingerprint of the value's hash
+        auto fingerprint_at(compact_index compactIndex) const {
+            return fingerprints()[compactIndex.value()];
+        }
+
+        // The hash of the value at compactIndex (which must be a value)
+        auto value_hash_at(compact_index compactIndex) const -> size_t {
+            assert( is_value_at( compactIndex ) );
+            return storesInline
+                ? reinterpret_cast<size_t>( m_children[compactIndex.value()] ) // NOLINT
+                : static_cast<leaf_node<T> const*>( m_children[compactIndex.value()] )->hash();
+        }
+
+        // (For an inline value this is not a pointer to a real node - see kind_at)
         auto get_at(compact_index compactIndex) const {
             return m_children[compactIndex.value()];
         }
         auto get_at(sparse_index sparseIndex) const -> node const* {
+            if( m_wide )
+                return m_children[sparseIndex.value()];
             if( ( m_bitmap & sparseIndex.bit_position() ) == 0 )
                 return nullptr;
             return get_at(sparseIndex.toCompact(m_bitmap));
@@ -471,80 +1361,109 @@ namespace hamt {
             size_t compactIndex;
             size_t width;
         };
-        Level m_levels[detail::maxDepth];
-
-        leaf_node<T> const* m_leaf;
+        Level m_levels[detail::maxDepth+1];
 
         size_t m_depth;
+        size_t m_valueIndex = 0; // within a leaf or bitmap that holds more than one value
 
         void descend_from(branch_node<T> const *branch, size_t depth) {
-            leaf_node<T> const* leaf = nullptr;
-            while( !leaf ) {
+            while( true ) {
                 assert( branch->size() > 0 );
-                m_levels[depth++] = { branch, 0, branch->size() };
-                auto nextNode = branch->get_at(compact_index(0));
-                assert( nextNode );
-                if( nextNode->m_type == node_type::leaf )
-                    leaf = static_cast<leaf_node<T> const*>( nextNode );
-                else {
-                    assert( branch->size() > 1 ); // If this is a branch with a non-leaf child it must have at least two children in total
-                    branch = static_cast<branch_node<T> const*>( nextNode );
-                }
+                auto first = compact_index( branch->next_occupied( 0 ) );
+                m_levels[depth++] = { branch, first.value(), branch->capacity() };
+                if( branch->kind_at( first ) != child_kind::branch )
+                    break;
+                auto nextNode = branch->get_at( first );
+                // If this is a (non-root) branch with a non-leaf child it must have at least two children in total
+                assert( depth == 1 || branch->size() > 1 );
+                branch = static_cast<branch_node<T> const*>( nextNode );
             };
-            m_leaf = leaf;
             m_depth = depth;
-            assert( m_leaf->size() == 1 );
         }
+
+        auto current_kind() const {
+            auto const& level = m_levels[m_depth-1];
+            return level.branch->kind_at( compact_index( level.compactIndex ) );
+        }
+        auto current_node() const {
+            auto const& level = m_levels[m_depth-1];
+            return level.branch->get_at( compact_index( level.compactIndex ) );
+        }
+
+        // The number of values held at the current position
+        auto values_here() const -> size_t {
+            switch( current_kind() ) {
+                case child_kind::leaf: return static_cast<leaf_node<T> const*>( current_node() )->size();
+                case child_kind::bitmap: return static_cast<bitmap_node const*>( current_node() )->size();
+                default: return 1;
+            }
+        }
+
+        auto current_value( std::false_type /*storesInline*/ ) const -> T {
+            return T( static_cast<leaf_node<T> const*>( current_node() )->get_at( m_valueIndex ) );
+        }
+        auto current_value( std::true_type /*storesInline*/ ) const -> T {
+            auto const& level = m_levels[m_depth-1];
+            auto compactIndex = compact_index( level.compactIndex );
+            auto hash = level.branch->kind_at( compactIndex ) == child_kind::bitmap
+                ? static_cast<bitmap_node const*>( current_node() )->hash_at( m_valueIndex )
+                : level.branch->value_hash_at( compactIndex );
+            return detail::value_hashing<T>::value( hash );
+        }
+
     public:
         explicit iterator( branch_node<T> const* root ) {
-            if( root ) {
+            if( root && root->size() > 0 ) {
                 descend_from(root, 0);
             }
             else {
                 m_depth = 0;
-                m_leaf = nullptr;
             }
         }
 
         auto operator==( iterator const& other ) const -> bool {
-            return m_leaf == other.m_leaf;
+            if( m_depth != other.m_depth )
+                return false;
+            if( m_depth == 0 )
+                return true;
+            auto const& level = m_levels[m_depth-1];
+            auto const& otherLevel = other.m_levels[m_depth-1];
+            return level.branch == otherLevel.branch &&
+                   level.compactIndex == otherLevel.compactIndex &&
+                   m_valueIndex == other.m_valueIndex;
         }
         auto operator!=( iterator const& other ) const -> bool {
-            return m_leaf != other.m_leaf;
+            return !operator==( other );
         }
         auto operator++() -> iterator& {
-            auto& level = m_levels[m_depth-1];
-
-            // !TBD: If multiple values, iterate those first
-
-            if( ++level.compactIndex == level.width ) {
-                if( --m_depth > 0 ) {
-                    return operator++();
-                }
-                else { // NOLINT
-                    m_leaf = nullptr;
-                    return *this;
+            if( ++m_valueIndex < values_here() )
+                return *this;
+            m_valueIndex = 0;
+
+            while( m_depth > 0 ) {
+                auto& level = m_levels[m_depth-1];
+                level.compactIndex = level.branch->next_occupied( level.compactIndex+1 );
+                if( level.compactIndex < level.width ) {
+                    if( current_kind() == child_kind::branch )
+                        descend_from(static_cast<branch_node<T> const *>( current_node() ), m_depth);
+                    break;
                 }
+                --m_depth;
             }
-            auto nextNode = level.branch->get_at(compact_index(level.compactIndex));
-            assert( nextNode );
-            if( nextNode->m_type == node_type::leaf )
-                m_leaf = static_cast<leaf_node<T> const*>( nextNode );
-            else
-                descend_from(static_cast<branch_node<T> const *>( nextNode ), m_depth);
-
             return *this;
         }
 
         auto operator *() const {
-            // !TBD: current value
-            return m_leaf->get_at(0);
+            return current_value( std::integral_constant<bool, detail::value_hashing<T>::storesInline>() );
         }
     };
 
 
-    // Traces a path of branch_nodes and hash chunks down to either a leaf_node
-    // that matches the given hash, or the last matching branch_node.
+    // Traces a path of branch_nodes and hash chunks down to either the value (or bitmap)
+    // at the position of the given hash, or the last matching branch_node.
+    // If the last branch's compressed prefix does not match the hash then
+    // prefix_mismatch() is true and chunked_hash() is positioned at the start of
+    // that prefix, rather than at the chunk that would index the branch
     template<typename T>
     class path {
 
@@ -553,89 +1472,174 @@ namespace hamt {
 
         branch_node<T> const *m_lastBranch;
         detail::chunked_hash m_chunkedHash;
-        leaf_node<T> const* m_leaf;
+        size_t m_index = 0;
+        child_kind m_kind = child_kind::none;
+        node const* m_child = nullptr;
         size_t m_size = 0;
+        bool m_prefixMismatch = false;
+
+        auto rewrite_from( size_t size, node const* newNode ) const -> branch_node<T> const* {
+            auto currentNode = newNode;
+
+            for( auto i = size; i > 0; --i ) {
+                auto parent = m_branches[i - 1]->with_replaced(sparse_index(m_chunks[i - 1]), currentNode);
+                currentNode = parent.release();
+            }
+            assert( currentNode->m_type == node_type::branch );
+            return static_cast<branch_node<T> const*>( currentNode );
+        }
 
     public:
-        path( T const& value, branch_node<T> const* root ) : m_chunkedHash( std::hash<T>()( value ) ) { // NOLINT
+        path( T const& value, branch_node<T> const* root ) : path( detail::chunked_hash( detail::hash_of( value ) ), root ) {}
+
+        // From a branch below the root, too, with the hash already consumed down to its index
+        // (the value's hash must share everything above that - including the branch's prefix)
+        path( detail::chunked_hash chunkedHash, branch_node<T> const* branch ) : m_chunkedHash( chunkedHash ) { // NOLINT
             size_t size = 0;
-            assert( root != nullptr );
-            auto lastBranch = root;
-            auto chunk = m_chunkedHash.chunk;
-            auto nextNode = lastBranch->get_at( sparse_index( chunk ) );
+            assert( branch != nullptr );
+            assert( branch->skip() <= chunkedHash.depth );
+            auto lastBranch = branch;
+            auto index = lastBranch->index_of( m_chunkedHash );
+
+            while( lastBranch->has_child( index ) ) {
+                auto compactIndex = lastBranch->to_compact( index );
+                m_kind = lastBranch->kind_at( compactIndex );
+                m_child = lastBranch->get_at( compactIndex );
+                if( m_kind != child_kind::branch )
+                    break;
 
-            while( nextNode && nextNode->m_type == node_type::branch ) {
                 m_branches[size] = lastBranch;
-                m_chunks[size] = chunk;
+                m_chunks[size] = index.value();
 
-                lastBranch = static_cast<branch_node<T> const*>( nextNode );
+                m_chunkedHash += lastBranch->chunks();
+                lastBranch = static_cast<branch_node<T> const*>( m_child );
+                m_kind = child_kind::none;
+                m_child = nullptr;
 
                 ++size;
-                ++m_chunkedHash;
 
-                chunk = m_chunkedHash.chunk;
-                nextNode = lastBranch->get_at( sparse_index( chunk ) );
+                if( !lastBranch->prefix_matches( m_chunkedHash ) ) {
+                    m_prefixMismatch = true;
+                    break;
+                }
+                m_chunkedHash += lastBranch->skip();
+
+                index = lastBranch->index_of( m_chunkedHash );
             };
 
             assert( size <= detail::maxDepth );
 
-            m_leaf = static_cast<leaf_node<T> const*>( nextNode );
             m_lastBranch = lastBranch;
+            m_index = index.value();
             m_size = size;
         }
 
         auto size() const -> size_t { return m_size; }
         auto last_branch() const { return m_lastBranch; }
-        auto leaf() const { return m_leaf; }
+        auto prefix_mismatch() const { return m_prefixMismatch; }
         auto whole_hash() const { return m_chunkedHash.hash; }
-        auto hash_chunk() const { return m_chunkedHash.chunk; }
         auto chunked_hash() const { return m_chunkedHash; }
 
-        auto rewrite( branch_node<T> const* newBranch ) const -> branch_node<T> const* {
-            auto currentBranch = newBranch;
+        // What is held at the hash chunk of the last branch (none if it is unset)
+        auto kind() const { return m_kind; }
+        auto leaf() const {
+            return m_kind == child_kind::leaf ? static_cast<leaf_node<T> const*>( m_child ) : nullptr;
+        }
+        auto bitmap() const {
+            return m_kind == child_kind::bitmap ? static_cast<bitmap_node const*>( m_child ) : nullptr;
+        }
+        auto inline_hash() const {
+            assert( m_kind == child_kind::inline_value );
+            return reinterpret_cast<size_t>( m_child ); // NOLINT
+        }
 
-            for( auto i = m_size; i > 0; --i ) {
-                auto parent = m_branches[i - 1]->with_replaced(sparse_index(m_chunks[i - 1]), currentBranch);
-                currentBranch = parent.release();
-            }
-            return currentBranch;
+        // The index into the last branch - a single hash chunk, unless the branch is wide
+        auto hash_chunk() const { return m_index; }
+
+        // The hash, as consumed by the time any child of the last branch is reached
+        auto child_chunked_hash() const { return m_chunkedHash + m_lastBranch->chunks(); }
+
+        // The branch that holds the last branch, and the chunk it is held at (only if size() > 0)
+        auto parent_branch() const { assert( m_size > 0 ); return m_branches[m_size-1]; }
+        auto parent_chunk() const { assert( m_size > 0 ); return m_chunks[m_size-1]; }
+
+        // Replaces the last branch with newNode (which may be a leaf or bitmap, when collapsing
+        // after an erase) and path-copies all the way back up to a new root.
+        // Takes ownership of newNode
+        auto rewrite( node const* newNode ) const -> branch_node<T> const* {
+            return rewrite_from( m_size, newNode );
+        }
+
+        // As above, but the last branch collapses to an inline value
+        auto rewrite( inline_value value ) const -> branch_node<T> const* {
+            assert( m_size > 0 );
+            auto parent = m_branches[m_size - 1]->with_replaced(sparse_index(m_chunks[m_size - 1]), value);
+            return rewrite_from( m_size - 1, parent.release() );
+        }
+
+        // Replaces the child at the hash chunk of the last branch, and rewrites the path
+        // up to a new root. Takes ownership of child
+        template<typename ChildT>
+        auto rewrite_child( ChildT child ) const -> branch_node<T> const* {
+            auto newBranch = m_lastBranch->with_replaced( sparse_index( m_index ), child );
+            return rewrite( newBranch.release() );
         }
     };
 
+    // The root carries the size of the trie, so this is a single pointer
     template<typename T>
     struct hash_trie_data {
         branch_node<T> const* m_root;
-        size_t m_size;
     };
 
-    template<typename T>
-    auto add_value_at_currently_unset_position(path<T> const &path, std::unique_ptr<leaf_node<T>> &&leaf) {
-        auto newBranch = path.last_branch()->with_inserted(sparse_index(path.hash_chunk()), leaf.get());
-        leaf.release();
-        auto newRoot = path.rewrite( newBranch.get() );
-        newBranch.release();
-        return newRoot;
+    // Takes ownership of child
+    template<typename T, typename ChildT>
+    auto add_value_at_currently_unset_position(path<T> const &path, ChildT child) {
+        auto newBranch = path.last_branch()->with_inserted(sparse_index(path.hash_chunk()), child);
+        return path.rewrite( newBranch.release() );
     }
 
-    template<typename T>
+    // Creates a single branch that holds both the existing value and the new one.
+    // Any chunks the two hashes have in common become the branch's compressed prefix,
+    // rather than a chain of single-child branches. Takes ownership of both children
+    template<typename T, typename ExistingT, typename NewT>
     auto extend
             (   detail::chunked_hash existingHash,
-                leaf_node<T> const *existingLeaf,
+                ExistingT existingChild,
                 detail::chunked_hash newHash,
-                std::unique_ptr<leaf_node<T>> &&newLeaf ) -> std::unique_ptr<branch_node<T>> {
-        if( existingHash.chunk == newHash.chunk ) {
-            auto newChildBranch = extend(existingHash + 1, existingLeaf, newHash + 1, std::move(newLeaf));
-            auto newParentBranch = branch_node<T>::create_single(sparse_index(newHash.chunk), newChildBranch.get());
-            newChildBranch.release();
-            return newParentBranch;
-        }
-        else { // NOLINT
-            auto newBranch = branch_node<T>::create_pair(sparse_index(existingHash.chunk), existingLeaf,
-                                                         sparse_index(newHash.chunk), newLeaf.get());
-            newLeaf.release();
-            addref(existingLeaf);
-            return newBranch;
-        }
+                NewT newChild ) -> std::unique_ptr<branch_node<T>> {
+        auto common = detail::common_chunks( existingHash.shiftedHash, newHash.shiftedHash );
+        assert( common <= detail::maxDepth );
+
+        auto prefix = newHash.shiftedHash;
+        existingHash += common;
+        newHash += common;
+        return branch_node<T>::create_pair(sparse_index(existingHash.chunk), existingChild,
+                                           sparse_index(newHash.chunk), newChild,
+                                           prefix, common);
+    }
+
+    // The last branch on the path has a prefix that diverges from the new value's hash,
+    // so split it at the point of divergence into a new branch holding both.
+    // Takes ownership of child
+    template<typename T, typename ChildT>
+    auto split_prefix( path<T> const &path, ChildT child ) -> branch_node<T> const* {
+        auto existingBranch = path.last_branch();
+        auto newHash = path.chunked_hash();
+        auto prefix = existingBranch->prefix();
+        auto common = detail::common_chunks( prefix, newHash.shiftedHash );
+        assert( common < existingBranch->skip() );
+
+        auto existingChunk = ( prefix >> ( common * detail::bitsPerChunk ) ) & detail::chunkMask;
+        auto existingRemainder = existingBranch->with_prefix
+                ( prefix >> ( (common+1) * detail::bitsPerChunk ),
+                  existingBranch->skip() - common - 1 );
+
+        newHash += common;
+        auto newBranch = branch_node<T>::create_pair(sparse_index(existingChunk), existingRemainder.release(),
+                                                     sparse_index(newHash.chunk), child,
+                                                     prefix, common);
+        return path.rewrite( newBranch.release() );
     }
 
     template<typename U, typename T>
@@ -646,72 +1650,273 @@ namespace hamt {
             return nullptr;
         }
 
-        detail::chunked_hash existingHash( existingLeaf->hash() );
-
         // If hash matches then add an extra value to the existing leaf node
-        if( existingHash.hash == path.whole_hash() ) {
-            auto newLeaf = existingLeaf->with_appended_value(value);
-            auto newBranch = path.last_branch()->with_replaced
-                    (sparse_index(path.hash_chunk()),
-                     newLeaf.get());
-
-            newLeaf.release();
-            auto newRoot = path.rewrite( newBranch.get());
-            newBranch.release();
-            return newRoot;
-        }
-
-        // Different hash, so add branches to the point they diverge
-        else { // NOLINT
-            existingHash += path.size();
-            auto newChildBranch = extend
-                    ( existingHash + 1,
-                      existingLeaf,
-                      path.chunked_hash() + 1,
-                      leaf_node<T>::create(std::forward<U>(value), path.whole_hash()));
-            auto newBranch = path.last_branch()->with_replaced
-                    (sparse_index(path.hash_chunk()),
-                     newChildBranch.get());
-            auto newRoot = path.rewrite(newBranch.get());
-            newChildBranch.release();
-            newBranch.release();
-            return newRoot;
-        }
+        if( existingLeaf->hash() == path.whole_hash() )
+            return path.rewrite_child( existingLeaf->with_appended_value(value).release() );
+
+        // Different hash, so add a branch at the point they diverge
+        // (the new leaf is made first, as copying the value may throw)
+        auto newLeaf = leaf_node<T>::create(std::forward<U>(value), path.whole_hash());
+        addref( existingLeaf );
+        auto newChildBranch = extend<T>
+                ( path.child_chunked_hash().rebased( existingLeaf->hash() ),
+                  existingLeaf,
+                  path.child_chunked_hash(),
+                  newLeaf.release() );
+        return path.rewrite_child( newChildBranch.release() );
     }
 
+    // Inline values whose hashes only differ in the final chunk go into a bitmap_node together,
+    // otherwise a branch is added at the point they diverge
+    template<typename T>
+    auto add_value_at_inline_value( path<T> const &path ) -> branch_node<T> const* {
+        auto existingHash = path.inline_hash();
+        auto newHash = path.whole_hash();
+        if( existingHash == newHash )
+            return nullptr;
+
+        if( detail::differ_only_in_final_chunk( existingHash, newHash ) )
+            return path.rewrite_child( bitmap_node::create( existingHash, newHash ).release() );
+
+        auto newChildBranch = extend<T>
+                ( path.child_chunked_hash().rebased( existingHash ), inline_value( existingHash ),
+                  path.child_chunked_hash(), inline_value( newHash ) );
+        return path.rewrite_child( newChildBranch.release() );
+    }
+
+    template<typename T>
+    auto add_value_at_bitmap( path<T> const &path ) -> branch_node<T> const* {
+        auto existingBitmap = path.bitmap();
+        auto newHash = path.whole_hash();
+        if( existingBitmap->contains( newHash ) )
+            return nullptr;
+
+        if( existingBitmap->matches( newHash ) )
+            return path.rewrite_child( existingBitmap->with_hash( newHash ).release() );
+
+        addref( existingBitmap );
+        auto newChildBranch = extend<T>
+                ( path.child_chunked_hash().rebased( existingBitmap->base() ),
+                  existingBitmap,
+                  path.child_chunked_hash(), inline_value( newHash ) );
+        return path.rewrite_child( newChildBranch.release() );
+    }
+
+    // Inserts a value at the end of the path found for it, returning the new first branch of the
+    // path (or null if the value was already there)
     template<typename U, typename T>
-    static auto inserted( branch_node<T> const* root, U &&value) -> branch_node<T> const* {
+    static auto inserted_at( path<T> const& path, U &&value) -> branch_node<T> const* {
         static_assert( std::is_constructible<T, decltype(std::forward<U>(value))>::value, "value must be convertible to T" );
 
-        path<T> path( value, root );
+        if( detail::value_hashing<T>::storesInline ) {
+            auto newValue = inline_value( path.whole_hash() );
+            if( path.prefix_mismatch() )
+                return split_prefix( path, newValue );
+            switch( path.kind() ) {
+                case child_kind::inline_value: return add_value_at_inline_value( path );
+                case child_kind::bitmap: return add_value_at_bitmap( path );
+                default: return add_value_at_currently_unset_position( path, newValue );
+            }
+        }
+
+        if( path.prefix_mismatch() )
+            return split_prefix( path, leaf_node<T>::create(std::forward<U>(value), path.whole_hash() ).release() );
 
         return path.leaf()
                ? add_value_at_leaf( path, std::forward<U>(value) )
                : add_value_at_currently_unset_position
-                       ( path, leaf_node<T>::create(std::forward<U>(value), path.whole_hash() ) );
+                       ( path, leaf_node<T>::create(std::forward<U>(value), path.whole_hash() ).release() );
+    }
+
+    template<typename U, typename T>
+    static auto inserted( branch_node<T> const* root, U &&value) -> branch_node<T> const* {
+        return inserted_at( path<T>( value, root ), std::forward<U>(value) );
+    }
+
+    // Removes the last branch's child at the path's chunk. A non-root branch left with only one
+    // child is collapsed into its parent: a remaining value (or bitmap) just moves up a level, and a
+    // remaining branch absorbs this branch's prefix (and chunk) into its own, so prefixes are re-merged
+    template<typename T>
+    auto remove_from_last_branch( path<T> const &path ) -> branch_node<T> const* {
+        auto branch = path.last_branch();
+        auto index = sparse_index( path.hash_chunk() );
+
+        if( path.size() == 0 && branch->size() == 1 )
+            return branch_node<T>::empty();
+
+        if( path.size() == 0 || branch->size() > 2 ) {
+            auto newBranch = branch->with_removed( index );
+            return path.rewrite( newBranch.release() );
+        }
+
+        assert( branch->size() == 2 && !branch->is_wide() );
+        auto remainingIndex = compact_index( branch->to_compact( index ).value() == 0 ? 1 : 0 );
+        auto remaining = branch->get_at( remainingIndex );
+
+        switch( branch->kind_at( remainingIndex ) ) {
+            case child_kind::inline_value:
+                return path.rewrite( inline_value( branch->value_hash_at( remainingIndex ) ) );
+            case child_kind::branch:
+                break;
+            default:
+                addref( remaining );
+                return path.rewrite( remaining );
+        }
+
+        // The remaining chunk is the one whose bit is still set once ours is removed
+        auto remainingChunk = static_cast<size_t>( __builtin_ctzll( branch->bitmap() & ~index.bit_position() ) );
+        auto remainingBranch = static_cast<branch_node<T> const*>( remaining );
+        auto shift = branch->skip() * detail::bitsPerChunk;
+        auto merged = remainingBranch->with_prefix
+                ( branch->prefix() | ( remainingChunk << shift ) | ( remainingBranch->prefix() << ( shift + detail::bitsPerChunk ) ),
+                  branch->skip() + 1 + remainingBranch->skip() );
+        return path.rewrite( merged.release() );
+    }
+
+    // Finds a value, without recording the path taken. Leaf children are checked against the
+    // fingerprint their parent holds for them first, so most misses never load the leaf itself.
+    // Inline values need no further load at all
+    template<typename T, typename K>
+    auto lookup( branch_node<T> const* root, K const& value ) -> bool {
+        constexpr bool storesInline = detail::value_hashing<T>::storesInline;
+        detail::chunked_hash chunkedHash( detail::hash_of( value ) );
+        auto fingerprint = detail::fingerprint( chunkedHash.hash );
+        auto branch = root;
+
+        while( true ) {
+            auto sparseIndex = branch->index_of( chunkedHash );
+            if( !branch->has_child( sparseIndex ) )
+                return false;
+
+            auto compactIndex = branch->to_compact( sparseIndex );
+            if( branch->is_value_at( compactIndex ) ) {
+                if( storesInline )
+                    return branch->value_hash_at( compactIndex ) == chunkedHash.hash;
+                if( branch->fingerprint_at( compactIndex ) != fingerprint )
+                    return false;
+                auto leaf = static_cast<leaf_node<T> const*>( branch->get_at( compactIndex ) );
+                return leaf->hash() == chunkedHash.hash && leaf->find( value );
+            }
+
+            auto child = branch->get_at( compactIndex );
+            if( storesInline && child->m_type == node_type::bitmap )
+                return static_cast<bitmap_node const*>( child )->contains( chunkedHash.hash );
+
+            chunkedHash += branch->chunks();
+            branch = static_cast<branch_node<T> const*>( child );
+            if( !branch->prefix_matches( chunkedHash ) )
+                return false;
+            chunkedHash += branch->skip();
+        }
+    }
+
+    // Returns a new reference to the (possibly level compressed) equivalent of branch.
+    // depth is the number of chunks consumed by the time the branch is indexed
+    template<typename T>
+    auto compacted( branch_node<T> const* branch, size_t depth ) -> branch_node<T> const* {
+        std::unique_ptr<branch_node<T>> widened;
+        if( branch->wide_occupancy( depth ) >= detail::wideThreshold ) {
+            widened = branch->widened( depth );
+            branch = widened.get();
+        }
+
+        auto childDepth = depth + branch->chunks();
+        bool childrenChanged = false;
+        auto newBranch = branch->transformed( [&]( node const* child ) -> node const* {
+            if( child->m_type != node_type::branch ) {
+                addref( child );
+                return child;
+            }
+            auto childBranch = static_cast<branch_node<T> const*>( child );
+            auto newChild = compacted( childBranch, childDepth + childBranch->skip() );
+            childrenChanged = childrenChanged || newChild != childBranch;
+            return newChild;
+        } );
+
+        // (discarded nodes go through release, rather than unique_ptr, to keep debug ref counts balanced)
+        if( childrenChanged ) {
+            if( widened )
+                release( widened.release() );
+            return newBranch.release();
+        }
+        release( newBranch.release() );
+        if( widened )
+            return widened.release();
+        addref( branch );
+        return branch;
     }
 
+    // Returns the new root, or nullptr if the value was not present
     template<typename T>
+    auto erased( branch_node<T> const* root, T const& value ) -> branch_node<T> const* {
+        path<T> path( value, root );
+
+        if( auto bitmap = path.bitmap() ) {
+            if( !bitmap->contains( path.whole_hash() ) )
+                return nullptr;
+            if( bitmap->size() > 2 )
+                return path.rewrite_child( bitmap->without_hash( path.whole_hash() ).release() );
+
+            // The one that is left no longer needs a bitmap
+            auto remainingHash = bitmap->hash_at( bitmap->hash_at( 0 ) == path.whole_hash() ? 1 : 0 );
+            return path.rewrite_child( inline_value( remainingHash ) );
+        }
+        if( path.kind() == child_kind::inline_value )
+            return path.inline_hash() == path.whole_hash() ? remove_from_last_branch( path ) : nullptr;
+
+        auto leaf = path.leaf();
+        if( !leaf || !leaf->find( value ) )
+            return nullptr;
+
+        if( leaf->size() > 1 )
+            return path.rewrite_child( leaf->without_value( value ).release() );
+        return remove_from_last_branch( path );
+    }
+
+    struct hazard_pointer_reclamation;
+
+    template<typename T, typename Reclamation = hazard_pointer_reclamation>
     class shared_hash_trie;
 
+    template<typename T, typename Reclamation = hazard_pointer_reclamation>
+    class hash_trie_transaction;
+
+    template<typename T, typename Reclamation = hazard_pointer_reclamation>
+    class version_history;
+
+    template<typename T, typename Reclamation = hazard_pointer_reclamation>
+    class change_feed;
+
     template<typename T>
     class hash_trie {
 
         hash_trie_data<T> m_data;
-        friend shared_hash_trie<T>;
+        template<typename, typename> friend class shared_hash_trie;
+        template<typename, typename> friend class version_history;
+
+        static auto makeEmptyData() noexcept -> hash_trie_data<T> {
+            return { branch_node<T>::empty() };
+        }
 
-        static auto makeEmptyData() -> hash_trie_data<T> {
-            return { branch_node<T>::create_empty().release(), 0 };
+        // Takes ownership of a root that has just been created (so is not yet shared),
+        // or the existing root, and records the new size of the trie in it
+        void set_root( branch_node<T> const* newRoot, size_t size ) {
+            if( newRoot->m_count != size ) {
+                assert( !newRoot->m_immortal && newRoot->m_refCount.load( std::memory_order_relaxed ) == 1 );
+                const_cast<branch_node<T>*>( newRoot )->m_count = size; // NOLINT
+            }
+            release( m_data.m_root );
+            m_data.m_root = newRoot;
         }
 
     public:
-        hash_trie() : m_data( makeEmptyData() ) {}
+        hash_trie() noexcept : m_data( makeEmptyData() ) {}
 
         explicit hash_trie( hash_trie_data<T> const& data ) : m_data( data ) {
             addref( m_data.m_root );
         }
         hash_trie( hash_trie<T> const& other ) : hash_trie( other.m_data ) {}
-        hash_trie( hash_trie<T>&& other ) noexcept(false) : hash_trie() {
+        hash_trie( hash_trie<T>&& other ) noexcept : hash_trie() {
             swap( other );
         }
 
@@ -724,35 +1929,60 @@ namespace hamt {
             swap( temp );
             return *this;
         }
-        hash_trie& operator = ( hash_trie&& other ) noexcept(false) {
-            if( !empty() ) {
-                hash_trie emptyTemp;
-                swap( emptyTemp );
-            }
+        hash_trie& operator = ( hash_trie&& other ) noexcept {
+            clear();
             swap( other );
             return *this;
         }
 
         void swap( hash_trie& other ) noexcept {
             std::swap( m_data.m_root, other.m_data.m_root );
-            std::swap( m_data.m_size, other.m_data.m_size );
         }
 
-        auto size() const -> size_t { return m_data.m_size; }
+        auto size() const -> size_t { return m_data.m_root->count(); }
         auto empty() const -> bool { return size() == 0; }
 
+        void clear() noexcept {
+            release( m_data.m_root );
+            m_data = makeEmptyData();
+        }
+
         auto find( T const& value ) const {
             return path<T>( value, m_data.m_root );
         }
 
+        auto contains( typename detail::lookup_key<T>::type const& value ) const -> bool {
+            return lookup( m_data.m_root, value );
+        }
+
         template<typename U>
         auto insert( U &&value ) {
-            if( auto newRoot = inserted( m_data.m_root, std::forward<U>(value) ) ) {
-                release( m_data.m_root );
-                m_data = { newRoot, size()+1 };
+            if( auto newRoot = inserted( m_data.m_root, std::forward<U>(value) ) )
+                set_root( newRoot, size()+1 );
+        }
+
+        // Returns true if the value was present
+        auto erase( T const& value ) -> bool {
+            if( auto newRoot = erased( m_data.m_root, value ) ) {
+                set_root( newRoot, size()-1 );
+                return true;
             }
+            return false;
+        }
+
+        // Level-compresses any dense subtrees, so lookups take fewer hops.
+        // Those subtrees fall back to regular branches as they thin out again
+        void compact() {
+            if( empty() )
+                return;
+            set_root( compacted( m_data.m_root, 0 ), size() );
         }
 
+        // Builds a trie of the values in [first, last), as tasks on executor: pieces of the range
+        // are built separately, then merged under each root chunk (see the definition, after the executors)
+        template<typename It, typename Executor>
+        static auto parallel_from_range( It first, It last, Executor& executor ) -> hash_trie;
+
         auto begin() -> iterator<T> {
             return iterator<T>( m_data.m_root );
         }
@@ -764,111 +1994,3148 @@ namespace hamt {
         auto data() -> hash_trie_data<T>& { return m_data; }
     };
 
+    // Read-only access to a trie that is kept alive by something else (e.g. for the duration of a
+    // shared_hash_trie::read() call), so it takes no references of its own
     template<typename T>
-    class hash_trie_transaction;
+    class hash_trie_view {
+        branch_node<T> const* m_root;
 
-    template<typename T>
-    class shared_hash_trie { // NOLINT
-        static_assert( std::is_trivially_copyable<hash_trie_data<T>>::value,
-                       "hash_trie_data must be trivially copyable to be used atomically" );
+    public:
+        explicit hash_trie_view( branch_node<T> const* root ) : m_root( root ) {}
+        hash_trie_view( hash_trie<T> const& hash_trie ) : m_root( hash_trie.data().m_root ) {} // NOLINT
 
-        std::atomic<hash_trie_data<T>> m_data;
+        auto size() const -> size_t { return m_root->count(); }
+        auto empty() const -> bool { return size() == 0; }
 
-        static auto makeEmptyData() -> hash_trie_data<T> {
-            return { branch_node<T>::create_empty().release(), 0 };
+        auto contains( typename detail::lookup_key<T>::type const& value ) const -> bool {
+            return lookup( m_root, value );
         }
 
-    public:
-        shared_hash_trie& operator = ( shared_hash_trie const& ) = delete;
-        shared_hash_trie& operator = ( shared_hash_trie&& ) = delete;
-
-        shared_hash_trie() : m_data( makeEmptyData() ) {}
-
-        explicit shared_hash_trie( hash_trie<T> const& hash_trie ) {
-            m_data.store( hash_trie.data(), std::memory_order_relaxed );
-            addref( hash_trie.data().m_root );
+        auto begin() const -> iterator<T> {
+            return iterator<T>( m_root );
+        }
+        auto end() const -> iterator<T> {
+            return iterator<T>( nullptr );
         }
 
-        auto data() const -> hash_trie_data<T> {
-            return m_data.load( std::memory_order_relaxed );
+        // Takes a reference, so the result can outlive whatever was keeping the view alive
+        auto snapshot() const -> hash_trie<T> {
+            return hash_trie<T>( hash_trie_data<T>{ m_root } );
         }
+    };
 
-        auto get() const -> hash_trie<T> {
-            return hash_trie<T>( data() );
+    namespace detail {
+        // Calls f with each value held in a branch's child slot, however it is stored
+        template<typename T, typename F>
+        void for_each_value_at( branch_node<T> const* branch, compact_index compactIndex, F const& f ) {
+            auto child = branch->get_at( compactIndex );
+            switch( branch->kind_at( compactIndex ) ) {
+                case child_kind::branch:
+                    for( iterator<T> it( static_cast<branch_node<T> const*>( child ) ), end( nullptr ); it != end; ++it )
+                        f( *it );
+                    break;
+                case child_kind::leaf: {
+                    auto leaf = static_cast<leaf_node<T> const*>( child );
+                    for( size_t i = 0; i < leaf->size(); ++i )
+                        f( T( leaf->get_at( i ) ) );
+                    break;
+                }
+                default:
+                    if constexpr( value_hashing<T>::storesInline ) {
+                        if( branch->kind_at( compactIndex ) == child_kind::bitmap ) {
+                            auto bitmap = static_cast<bitmap_node const*>( child );
+                            for( size_t i = 0; i < bitmap->size(); ++i )
+                                f( value_hashing<T>::value( bitmap->hash_at( i ) ) );
+                        }
+                        else
+                            f( value_hashing<T>::value( branch->value_hash_at( compactIndex ) ) );
+                    }
+                    break;
+            }
         }
 
-        auto start_transaction() -> hash_trie_transaction<T>;
+        // Walks two tries together, lining up their branches by position, and skipping any
+        // child the two share. Where the structure doesn't line up (e.g. one side is level
+        // compressed, or a value has become a branch) the values on each side are looked up
+        // in the other trie instead
+        template<typename T, typename Added, typename Removed>
+        class trie_differ {
+            branch_node<T> const* m_oldRoot;
+            branch_node<T> const* m_newRoot;
+            Added const& m_onAdded;
+            Removed const& m_onRemoved;
+
+            void report_removed( branch_node<T> const* branch, compact_index compactIndex ) const {
+                for_each_value_at( branch, compactIndex, [&]( T const& value ) {
+                    if( !lookup( m_newRoot, value ) )
+                        m_onRemoved( value );
+                } );
+            }
+            void report_added( branch_node<T> const* branch, compact_index compactIndex ) const {
+                for_each_value_at( branch, compactIndex, [&]( T const& value ) {
+                    if( !lookup( m_oldRoot, value ) )
+                        m_onAdded( value );
+                } );
+            }
 
-        template<typename L>
-        void update_with(L const &updateTask);
+            // Two child slots at the same position, either of which may be empty
+            void diff_slots( branch_node<T> const* oldBranch, bool oldHas, compact_index oldIndex,
+                             branch_node<T> const* newBranch, bool newHas, compact_index newIndex ) const {
+                if( oldHas && newHas ) {
+                    auto kind = oldBranch->kind_at( oldIndex );
+                    if( kind == newBranch->kind_at( newIndex ) ) {
+                        // (for an inline value, the same "pointer" is the same value)
+                        if( oldBranch->get_at( oldIndex ) == newBranch->get_at( newIndex ) )
+                            return;
+                        if( kind == child_kind::branch ) {
+                            diff_branches( static_cast<branch_node<T> const*>( oldBranch->get_at( oldIndex ) ),
+                                           static_cast<branch_node<T> const*>( newBranch->get_at( newIndex ) ) );
+                            return;
+                        }
+                    }
+                }
+                if( oldHas )
+                    report_removed( oldBranch, oldIndex );
+                if( newHas )
+                    report_added( newBranch, newIndex );
+            }
 
-        // "low level" compare-exchange wrapper - use transaction
-        auto reset( hash_trie_data<T>& originalData,
-                    hash_trie_data<T>& newData ) -> bool {
-            if( !m_data.compare_exchange_strong
-                    ( originalData, newData,
-                      std::memory_order_release,
-                      std::memory_order_relaxed ) )
-                return false;
+        public:
+            trie_differ( branch_node<T> const* oldRoot, branch_node<T> const* newRoot,
+                         Added const& onAdded, Removed const& onRemoved )
+            :   m_oldRoot( oldRoot ),
+                m_newRoot( newRoot ),
+                m_onAdded( onAdded ),
+                m_onRemoved( onRemoved )
+            {}
 
-            release( originalData.m_root );
-            addref( newData.m_root );
-            return true;
-        }
+            // Two branches at the same position in their tries
+            void diff_branches( branch_node<T> const* oldBranch, branch_node<T> const* newBranch ) const {
+                if( oldBranch == newBranch )
+                    return;
+
+                if( oldBranch->is_wide() != newBranch->is_wide() ||
+                    oldBranch->skip() != newBranch->skip() ||
+                    oldBranch->prefix() != newBranch->prefix() ) {
+                    for( auto i = oldBranch->next_occupied( 0 ); i < oldBranch->capacity(); i = oldBranch->next_occupied( i+1 ) )
+                        report_removed( oldBranch, compact_index( i ) );
+                    for( auto i = newBranch->next_occupied( 0 ); i < newBranch->capacity(); i = newBranch->next_occupied( i+1 ) )
+                        report_added( newBranch, compact_index( i ) );
+                    return;
+                }
 
-        auto is_lock_free() const { return m_data.is_lock_free(); }
-    };
+                if( oldBranch->is_wide() ) {
+                    // (slots are indexed directly, so compact indices are also positions)
+                    auto oldIndex = oldBranch->next_occupied( 0 );
+                    auto newIndex = newBranch->next_occupied( 0 );
+                    while( oldIndex < wideSlots || newIndex < wideSlots ) {
+                        auto index = std::min( oldIndex, newIndex );
+                        diff_slots( oldBranch, oldIndex == index, compact_index( index ),
+                                    newBranch, newIndex == index, compact_index( index ) );
+                        if( oldIndex == index )
+                            oldIndex = oldBranch->next_occupied( index+1 );
+                        if( newIndex == index )
+                            newIndex = newBranch->next_occupied( index+1 );
+                    }
+                    return;
+                }
 
-    template<typename T>
-    class hash_trie_transaction {
-        hash_trie_data<T> m_baseData; // For compare-exchange
-        shared_hash_trie<T>& m_shared;
+                for( auto bitmap = oldBranch->bitmap() | newBranch->bitmap(); bitmap != 0; bitmap &= bitmap-1 ) {
+                    sparse_index sparseIndex( static_cast<size_t>( __builtin_ctzll( bitmap ) ) );
+                    diff_slots( oldBranch, oldBranch->has_child( sparseIndex ), oldBranch->to_compact( sparseIndex ),
+                                newBranch, newBranch->has_child( sparseIndex ), newBranch->to_compact( sparseIndex ) );
+                }
+            }
+        };
 
-    public:
-        explicit hash_trie_transaction( shared_hash_trie<T>& shared )
-        : m_baseData( shared.data() ),
-          m_shared( shared )
-        {
-            addref( m_baseData.m_root );
-        }
+        // Takes the values of one trie (b) out of another (a), walking the two together as
+        // trie_differ does. A subtree the two share is dropped whole, and one that b has nothing
+        // alongside is kept whole - so is shared with the result. Where the structure doesn't
+        // line up, a's values are looked up in b instead. Branches left with a single child are
+        // collapsed into their parents, as erase does
+        template<typename T>
+        class trie_subtracter {
+            static constexpr bool storesInline = value_hashing<T>::storesInline;
+
+            // What is left of one of a's children (or branches) once b's values are taken out
+            struct remainder {
+                enum { unchanged, removed, replaced } state = unchanged;
+                child_kind kind = child_kind::none;
+                node const* child = nullptr; // owned until placed in a branch (or an inline value's hash)
+
+                remainder() = default;
+                remainder( child_kind kind, node const* child ) : state( replaced ), kind( kind ), child( child ) {}
+                remainder( remainder&& other ) noexcept
+                :   state( other.state ), kind( other.kind ), child( std::exchange( other.child, nullptr ) )
+                {}
+                remainder& operator = ( remainder&& other ) noexcept {
+                    std::swap( state, other.state );
+                    std::swap( kind, other.kind );
+                    std::swap( child, other.child );
+                    return *this;
+                }
+                ~remainder() {
+                    if( !child )
+                        return;
+                    switch( kind ) {
+                        case child_kind::branch: release( static_cast<branch_node<T> const*>( child ) ); break;
+                        case child_kind::leaf: release( static_cast<leaf_node<T> const*>( child ) ); break;
+                        case child_kind::bitmap: release( static_cast<bitmap_node const*>( child ) ); break;
+                        default: break;
+                    }
+                }
 
-        auto get() const -> hash_trie<T> {
-            return hash_trie<T>( m_baseData );
-        }
+                static auto none() -> remainder {
+                    remainder result;
+                    result.state = removed;
+                    return result;
+                }
+                static auto inline_hash( size_t hash ) -> remainder {
+                    return { child_kind::inline_value, reinterpret_cast<node const*>( hash ) }; // NOLINT
+                }
+            };
 
-        auto try_commit(hash_trie<T> &newHashTrie) -> bool {
-            return m_shared.reset( m_baseData, newHashTrie.data() );
-        }
+            branch_node<T> const* m_bRoot;
+
+            template<typename V>
+            auto in_b( V const& value ) const -> bool { return lookup( m_bRoot, value ); }
+
+            auto subtract_leaf( leaf_node<T> const* leaf ) const -> remainder {
+                size_t kept = 0;
+                for( size_t i = 0; i < leaf->size(); ++i )
+                    kept += in_b( leaf->get_at( i ) ) ? 0 : 1;
+                if( kept == leaf->size() )
+                    return {};
+                if( kept == 0 )
+                    return remainder::none();
+
+                // (hashes rarely collide, so this is rarely more than once)
+                remainder result( child_kind::leaf, leaf );
+                addref( leaf );
+                for( size_t i = 0; i < leaf->size(); ++i ) {
+                    if( in_b( leaf->get_at( i ) ) )
+                        result = remainder( child_kind::leaf, static_cast<leaf_node<T> const*>( result.child )
+                                                ->without_value( leaf->get_at( i ) ).release() );
+                }
+                return result;
+            }
 
-        template<typename L>
-        void update_with(L const &updateTask) {
-            while( true ) {
-                hash_trie<int> copy( m_baseData );
-                updateTask( copy );
+            auto subtract_bitmap( bitmap_node const* bitmap ) const -> remainder {
+                if constexpr( storesInline ) {
+                    size_t kept = 0;
+                    size_t lastKept = 0;
+                    for( size_t i = 0; i < bitmap->size(); ++i ) {
+                        if( !in_b( value_hashing<T>::value( bitmap->hash_at( i ) ) ) ) {
+                            ++kept;
+                            lastKept = bitmap->hash_at( i );
+                        }
+                    }
+                    if( kept == bitmap->size() )
+                        return {};
+                    if( kept == 0 )
+                        return remainder::none();
+                    if( kept == 1 )
+                        return remainder::inline_hash( lastKept );
+
+                    remainder result( child_kind::bitmap, bitmap );
+                    addref( bitmap );
+                    for( size_t i = 0; i < bitmap->size(); ++i ) {
+                        auto hash = bitmap->hash_at( i );
+                        if( in_b( value_hashing<T>::value( hash ) ) )
+                            result = remainder( child_kind::bitmap, static_cast<bitmap_node const*>( result.child )
+                                                    ->without_hash( hash ).release() );
+                    }
+                    return result;
+                }
+                else {
+                    assert( false ); // (only inline values are held in bitmaps)
+                    return {};
+                }
+            }
 
-                // If we didn't change, don't do anything
-                if( copy.data().m_root == m_baseData.m_root )
-                    break;
+            // a's child at compactIndex (sparseIndex), against b's branch at the same position
+            // - or null, if there is none that lines up
+            auto subtract_child( branch_node<T> const* a, compact_index compactIndex, sparse_index sparseIndex,
+                                 branch_node<T> const* b ) const -> remainder {
+                auto kind = a->kind_at( compactIndex );
+                auto child = a->get_at( compactIndex );
+                if( b ) {
+                    if( !b->has_child( sparseIndex ) )
+                        return {};
+                    auto bIndex = b->to_compact( sparseIndex );
+                    if( b->kind_at( bIndex ) == kind ) {
+                        // (for an inline value, the same "pointer" is the same value)
+                        if( b->get_at( bIndex ) == child )
+                            return remainder::none();
+                        if( kind == child_kind::branch )
+                            return subtract_branch( static_cast<branch_node<T> const*>( child ),
+                                                    static_cast<branch_node<T> const*>( b->get_at( bIndex ) ), false );
+                    }
+                }
+                switch( kind ) {
+                    case child_kind::branch:
+                        return subtract_branch( static_cast<branch_node<T> const*>( child ), nullptr, false );
+                    case child_kind::leaf:
+                        return subtract_leaf( static_cast<leaf_node<T> const*>( child ) );
+                    case child_kind::bitmap:
+                        return subtract_bitmap( static_cast<bitmap_node const*>( child ) );
+                    default:
+                        if constexpr( storesInline ) {
+                            if( in_b( value_hashing<T>::value( a->value_hash_at( compactIndex ) ) ) )
+                                return remainder::none();
+                        }
+                        return {};
+                }
+            }
 
-                // try to commit, and if successful we're done
-                if(try_commit(copy) )
-                    break;
+            static void place( branch_node<T>& branch, size_t index, branch_node<T> const& a, size_t aIndex, remainder& child ) {
+                if( child.state == remainder::unchanged )
+                    branch.share_child( index, a, aIndex );
+                else if( child.kind == child_kind::inline_value )
+                    branch.set_child( index, inline_value( reinterpret_cast<size_t>( child.child ) ) ); // NOLINT
+                else
+                    branch.set_child( index, std::exchange( child.child, nullptr ) );
+            }
 
-                // m_baseData has been updated with new base
-            };
-        }
-    };
+            // A non-root branch with a single child gives way to it: a value (or bitmap) just moves
+            // up a level, and a branch takes this branch's prefix (and chunk) onto its own
+            static auto collapsed( std::unique_ptr<branch_node<T>> branch ) -> remainder {
+                assert( branch->size() == 1 && !branch->is_wide() );
+                auto onlyIndex = compact_index( 0 );
+                auto kind = branch->kind_at( onlyIndex );
+                auto child = branch->get_at( onlyIndex );
+                remainder result;
+                if( kind == child_kind::inline_value )
+                    result = remainder::inline_hash( branch->value_hash_at( onlyIndex ) );
+                else if( kind != child_kind::branch ) {
+                    addref( child );
+                    result = remainder( kind, child );
+                }
+                else {
+                    auto onlyChunk = static_cast<size_t>( __builtin_ctzll( branch->bitmap() ) );
+                    auto onlyBranch = static_cast<branch_node<T> const*>( child );
+                    auto shift = branch->skip() * bitsPerChunk;
+                    result = remainder( kind, onlyBranch->with_prefix
+                            ( branch->prefix() | ( onlyChunk << shift ) | ( onlyBranch->prefix() << ( shift + bitsPerChunk ) ),
+                              branch->skip() + 1 + onlyBranch->skip() ).release() );
+                }
+                release( branch.release() );
+                return result;
+            }
 
-    template<typename T>
-    auto shared_hash_trie<T>::start_transaction() -> hash_trie_transaction<T> {
-        return hash_trie_transaction<T>( *this );
-    }
-    template<typename T>
-    template<typename L>
-    void shared_hash_trie<T>::update_with(L const &updateTask) {
-        auto trans = start_transaction();
-        trans.update_with(updateTask);
-    }
+            auto subtract_branch( branch_node<T> const* a, branch_node<T> const* b, bool isRoot ) const -> remainder {
+                if( b && ( a->is_wide() != b->is_wide() || a->skip() != b->skip() || a->prefix() != b->prefix() ) )
+                    b = nullptr;
+
+                // (indexed by compact index - which, for a wide branch, is also the slot)
+                remainder narrowChildren[1 << bitsPerChunk];
+                std::vector<remainder> wideChildren( a->is_wide() ? wideSlots : 0 );
+                auto children = a->is_wide() ? wideChildren.data() : narrowChildren;
+
+                bool changed = false;
+                size_t remaining = 0;
+                size_t bitmap = 0;
+                auto subtract = [&]( size_t index, sparse_index sparseIndex ) {
+                    children[index] = subtract_child( a, compact_index( index ), sparseIndex, b );
+                    changed = changed || children[index].state != remainder::unchanged;
+                    if( children[index].state != remainder::removed ) {
+                        ++remaining;
+                        if( !a->is_wide() )
+                            bitmap |= sparseIndex.bit_position();
+                    }
+                };
+                if( a->is_wide() ) {
+                    for( auto i = a->next_occupied( 0 ); i < a->capacity(); i = a->next_occupied( i+1 ) )
+                        subtract( i, sparse_index( i ) );
+                }
+                else {
+                    size_t i = 0;
+                    for( auto aBitmap = a->bitmap(); aBitmap != 0; aBitmap &= aBitmap-1, ++i )
+                        subtract( i, sparse_index( static_cast<size_t>( __builtin_ctzll( aBitmap ) ) ) );
+                }
+
+                if( !changed )
+                    return {};
+                if( remaining == 0 && !isRoot )
+                    return remainder::none();
+
+                std::unique_ptr<branch_node<T>> branch;
+                if( a->is_wide() ) {
+                    branch = branch_node<T>::create_wide_unpopulated( remaining );
+                    branch->set_prefix( a->prefix(), a->skip() );
+                    for( auto i = a->next_occupied( 0 ); i < a->capacity(); i = a->next_occupied( i+1 ) ) {
+                        if( children[i].state != remainder::removed )
+                            place( *branch, i, *a, i, children[i] );
+                    }
+                    if( remaining < narrowThreshold ) {
+                        auto narrowed = branch->narrowed( wideSlots ); // (nothing excluded)
+                        release( branch.release() );
+                        branch = std::move( narrowed );
+                    }
+                }
+                else {
+                    branch = branch_node<T>::create_unpopulated( remaining, bitmap );
+                    branch->set_prefix( a->prefix(), a->skip() );
+                    size_t index = 0;
+                    for( size_t i = 0; i < a->size(); ++i ) {
+                        if( children[i].state != remainder::removed )
+                            place( *branch, index++, *a, i, children[i] );
+                    }
+                }
+                if( branch->size() == 1 && !isRoot )
+                    return collapsed( std::move( branch ) );
+                return remainder( child_kind::branch, branch.release() );
+            }
+
+        public:
+            explicit trie_subtracter( branch_node<T> const* bRoot ) : m_bRoot( bRoot ) {}
+
+            // A new root, for the size values of a's root that are not in b (so at least one was)
+            auto subtracted( branch_node<T> const* aRoot, size_t size ) const -> branch_node<T> const* {
+                auto result = subtract_branch( aRoot, m_bRoot, true );
+                assert( result.state == remainder::replaced && result.kind == child_kind::branch );
+                auto root = static_cast<branch_node<T>*>( const_cast<node*>( std::exchange( result.child, nullptr ) ) ); // NOLINT
+                root->m_count = size;
+                return root;
+            }
+        };
+
+        // Adds the values of one trie (b) to another (a), walking the two together as trie_differ
+        // does. A subtree that only one side has anything alongside is shared with the result
+        // whole. Where the structure doesn't line up, the values under one side are inserted into
+        // the other side's subtree there, using the hashes their nodes already hold. The two must
+        // share no nodes (e.g. having been built separately), so a value in both is always met as
+        // the same inline value at the same position, or as one of those inserts finding it.
+        // Neither may have been compacted, so there are no wide branches to line up
+        template<typename T>
+        class trie_merger {
+            static constexpr bool storesInline = value_hashing<T>::storesInline;
+
+            size_t m_duplicates = 0;
+
+            static auto lined_up( branch_node<T> const* a, branch_node<T> const* b ) -> bool {
+                return a->skip() == b->skip() && a->prefix() == b->prefix();
+            }
+
+            // Calls onValue with each inline value under a branch's child, along with its hash,
+            // and onLeaf with each leaf
+            template<typename F, typename G>
+            static void for_each_under( branch_node<T> const* branch, compact_index compactIndex, F const& onValue, G const& onLeaf ) {
+                auto child = branch->get_at( compactIndex );
+                switch( branch->kind_at( compactIndex ) ) {
+                    case child_kind::branch: {
+                        auto childBranch = static_cast<branch_node<T> const*>( child );
+                        for( auto i = childBranch->next_occupied( 0 ); i < childBranch->capacity(); i = childBranch->next_occupied( i+1 ) )
+                            for_each_under( childBranch, compact_index( i ), onValue, onLeaf );
+                        break;
+                    }
+                    case child_kind::leaf:
+                        onLeaf( static_cast<leaf_node<T> const*>( child ) );
+                        break;
+                    case child_kind::bitmap:
+                        if constexpr( storesInline ) {
+                            auto bitmap = static_cast<bitmap_node const*>( child );
+                            for( size_t i = 0; i < bitmap->size(); ++i )
+                                onValue( value_hashing<T>::value( bitmap->hash_at( i ) ), bitmap->hash_at( i ) );
+                        }
+                        break;
+                    default:
+                        if constexpr( storesInline ) {
+                            auto hash = branch->value_hash_at( compactIndex );
+                            onValue( value_hashing<T>::value( hash ), hash );
+                        }
+                        break;
+                }
+            }
+
+            // A leaf goes in whole - unless there is already one with the same hash there, when
+            // its values are added to that one
+            auto inserted_leaf( branch_node<T> const* branch, size_t depth, leaf_node<T> const* leaf ) -> branch_node<T> const* {
+                path<T> leafPath( chunked_hash( leaf->hash() ) + depth, branch );
+                if( leafPath.prefix_mismatch() ) {
+                    addref( leaf );
+                    return split_prefix( leafPath, leaf );
+                }
+                auto existingLeaf = leafPath.leaf();
+                if( !existingLeaf ) {
+                    addref( leaf );
+                    return add_value_at_currently_unset_position( leafPath, leaf );
+                }
+                if( existingLeaf->hash() != leaf->hash() ) {
+                    addref( existingLeaf );
+                    addref( leaf );
+                    auto newChildBranch = extend<T>
+                            ( leafPath.child_chunked_hash().rebased( existingLeaf->hash() ), existingLeaf,
+                              leafPath.child_chunked_hash(), leaf );
+                    return leafPath.rewrite_child( newChildBranch.release() );
+                }
+                auto result = branch;
+                addref( result );
+                try {
+                    for( size_t i = 0; i < leaf->size(); ++i )
+                        result = replaced( result, inserted_at( path<T>( chunked_hash( leaf->hash() ) + depth, result ), leaf->get_at( i ) ) );
+                }
+                catch( ... ) {
+                    release( result );
+                    throw;
+                }
+                return result;
+            }
+
+            // Takes over from branch, if there is a new one (or just counts a duplicate)
+            auto replaced( branch_node<T> const* branch, branch_node<T> const* newBranch ) -> branch_node<T> const* {
+                if( !newBranch ) {
+                    ++m_duplicates;
+                    return branch;
+                }
+                release( branch );
+                return newBranch;
+            }
+
+            // Inserts the values under source's child into branch (whose index is taken at depth),
+            // returning the branch that replaces it
+            auto inserted_under( branch_node<T> const* branch, size_t depth,
+                                 branch_node<T> const* source, compact_index compactIndex ) -> branch_node<T> const* {
+                try {
+                    for_each_under( source, compactIndex,
+                        [&]( T const& value, size_t hash ) {
+                            branch = replaced( branch, inserted_at( path<T>( chunked_hash( hash ) + depth, branch ), value ) );
+                        },
+                        [&]( leaf_node<T> const* leaf ) {
+                            auto newBranch = inserted_leaf( branch, depth, leaf );
+                            release( branch );
+                            branch = newBranch;
+                        } );
+                }
+                catch( ... ) {
+                    release( branch );
+                    throw;
+                }
+                return branch;
+            }
+
+            // kept's child at sparseIndex of a branch whose index is taken at depth, with the
+            // values under other's child there added. They go in through a branch holding just the
+            // one child, so that each insert copies only that, rather than the whole branch
+            auto merged_child( branch_node<T> const* kept, compact_index keptIndex,
+                               branch_node<T> const* other, compact_index otherIndex,
+                               sparse_index sparseIndex, size_t depth ) -> branch_node<T> const* {
+                auto single = branch_node<T>::create_unpopulated( 1, sparseIndex.bit_position() );
+                single->share_child( 0, *kept, keptIndex.value() );
+                return inserted_under( single.release(), depth, other, otherIndex );
+            }
+
+            // a and b line up, with their index taken at depth
+            auto merged_branch( branch_node<T> const* a, branch_node<T> const* b, size_t depth ) -> branch_node<T> const* {
+                assert( !a->is_wide() && !b->is_wide() );
+                auto bitmap = a->bitmap() | b->bitmap();
+                auto branch = branch_node<T>::create_unpopulated( count_set_bits( static_cast<uint32_t>( bitmap ) ), bitmap );
+                branch->set_prefix( a->prefix(), a->skip() );
+                // (so, if a child throws, only those already placed are released)
+                std::fill( branch->m_children, branch->m_children + branch->capacity(), nullptr );
+                std::fill( branch->fingerprints(), branch->fingerprints() + branch->capacity(), 0 );
+
+                auto mergeSlot = [&]( size_t index, sparse_index sparseIndex ) {
+                    auto aIndex = a->to_compact( sparseIndex );
+                    auto bIndex = b->to_compact( sparseIndex );
+                    if( !b->has_child( sparseIndex ) )
+                        return branch->share_child( index, *a, aIndex.value() );
+                    if( !a->has_child( sparseIndex ) )
+                        return branch->share_child( index, *b, bIndex.value() );
+
+                    auto aKind = a->kind_at( aIndex );
+                    auto bKind = b->kind_at( bIndex );
+                    if( aKind == child_kind::branch && bKind == child_kind::branch ) {
+                        auto aChild = static_cast<branch_node<T> const*>( a->get_at( aIndex ) );
+                        auto bChild = static_cast<branch_node<T> const*>( b->get_at( bIndex ) );
+                        if( lined_up( aChild, bChild ) )
+                            return branch->set_child( index, merged_branch( aChild, bChild, depth + a->chunks() + aChild->skip() ) );
+                    }
+                    // (for an inline value, the same "pointer" is the same value)
+                    if( aKind == child_kind::inline_value && bKind == child_kind::inline_value
+                            && a->get_at( aIndex ) == b->get_at( bIndex ) ) {
+                        ++m_duplicates;
+                        return branch->share_child( index, *a, aIndex.value() );
+                    }
+                    // A branch stays where it is, and the values alongside go into it
+                    auto single = bKind == child_kind::branch && aKind != child_kind::branch
+                            ? merged_child( b, bIndex, a, aIndex, sparseIndex, depth )
+                            : merged_child( a, aIndex, b, bIndex, sparseIndex, depth );
+                    branch->share_child( index, *single, 0 );
+                    release( single );
+                };
+                try {
+                    size_t index = 0;
+                    for( ; bitmap != 0; bitmap &= bitmap-1 )
+                        mergeSlot( index++, sparse_index( static_cast<size_t>( __builtin_ctzll( bitmap ) ) ) );
+                }
+                catch( ... ) {
+                    release( branch.release() );
+                    throw;
+                }
+
+                return branch.release();
+            }
+
+        public:
+            // A new root, holding the values of both a's root and b's
+            auto merged( branch_node<T> const* aRoot, branch_node<T> const* bRoot ) -> branch_node<T> const* {
+                return merged_branch( aRoot, bRoot, 0 );
+            }
+
+            // How many of b's values were already in a
+            auto duplicates() const -> size_t { return m_duplicates; }
+        };
+
+        // The memory allocated for a branch, and everything below it
+        template<typename T>
+        auto subtree_bytes( branch_node<T> const* branch ) -> size_t;
+
+        template<typename T>
+        auto child_bytes( branch_node<T> const* branch, compact_index compactIndex ) -> size_t {
+            auto child = branch->get_at( compactIndex );
+            switch( branch->kind_at( compactIndex ) ) {
+                case child_kind::branch: return subtree_bytes( static_cast<branch_node<T> const*>( child ) );
+                case child_kind::leaf: return static_cast<leaf_node<T> const*>( child )->allocation_size();
+                case child_kind::bitmap: return static_cast<bitmap_node const*>( child )->allocation_size();
+                default: return 0; // (an inline value has no allocation of its own)
+            }
+        }
+
+        template<typename T>
+        auto subtree_bytes( branch_node<T> const* branch ) -> size_t {
+            if( branch->m_immortal )
+                return 0;
+            auto bytes = branch->allocation_size();
+            for( auto i = branch->next_occupied( 0 ); i < branch->capacity(); i = branch->next_occupied( i+1 ) )
+                bytes += child_bytes( branch, compact_index( i ) );
+            return bytes;
+        }
+
+        // The memory allocated for a branch and its descendants that isn't shared with other (a
+        // branch at the same position in another trie). Shared subtrees are skipped, as with diff
+        template<typename T>
+        auto unshared_bytes( branch_node<T> const* branch, branch_node<T> const* other ) -> size_t {
+            if( branch == other || branch->m_immortal )
+                return 0;
+            if( branch->is_wide() != other->is_wide() || branch->skip() != other->skip() || branch->prefix() != other->prefix() )
+                return subtree_bytes( branch );
+
+            auto bytes = branch->allocation_size();
+            auto addChild = [&]( compact_index compactIndex, sparse_index sparseIndex ) {
+                auto kind = branch->kind_at( compactIndex );
+                if( other->has_child( sparseIndex ) ) {
+                    auto otherIndex = other->to_compact( sparseIndex );
+                    if( other->kind_at( otherIndex ) == kind ) {
+                        if( other->get_at( otherIndex ) == branch->get_at( compactIndex ) )
+                            return;
+                        if( kind == child_kind::branch ) {
+                            bytes += unshared_bytes( static_cast<branch_node<T> const*>( branch->get_at( compactIndex ) ),
+                                                     static_cast<branch_node<T> const*>( other->get_at( otherIndex ) ) );
+                            return;
+                        }
+                    }
+                }
+                bytes += child_bytes( branch, compactIndex );
+            };
+            if( branch->is_wide() ) {
+                for( auto i = branch->next_occupied( 0 ); i < branch->capacity(); i = branch->next_occupied( i+1 ) )
+                    addChild( compact_index( i ), sparse_index( i ) );
+            }
+            else {
+                size_t i = 0;
+                for( auto bitmap = branch->bitmap(); bitmap != 0; bitmap &= bitmap-1, ++i )
+                    addChild( compact_index( i ), sparse_index( static_cast<size_t>( __builtin_ctzll( bitmap ) ) ) );
+            }
+            return bytes;
+        }
+    }
+
+    // Calls onAdded with each value in newTrie that is not in oldTrie, and onRemoved with each
+    // value in oldTrie that is not in newTrie. Subtrees that the two share (as versions of the
+    // same trie mostly do) are skipped without being visited, so the cost is in proportion to
+    // the size of the change, rather than of the tries
+    template<typename T, typename Added, typename Removed>
+    void diff( hash_trie<T> const& oldTrie, hash_trie<T> const& newTrie, Added const& onAdded, Removed const& onRemoved ) {
+        auto oldRoot = oldTrie.data().m_root;
+        auto newRoot = newTrie.data().m_root;
+        detail::trie_differ<T, Added, Removed>( oldRoot, newRoot, onAdded, onRemoved ).diff_branches( oldRoot, newRoot );
+    }
+
+    // Set algebra between tries. The result starts as a copy of one input, so it shares all of
+    // that input's nodes that it doesn't change. Where the inputs are of similar size (e.g. two
+    // versions of the same trie), the changes are found with diff(), which skips any subtree the
+    // two share - so the cost is in proportion to the difference between them. Where one is much
+    // smaller than the other, the smaller is just iterated, so the cost is in proportion to that
+    namespace detail {
+        template<typename T>
+        auto much_smaller( hash_trie<T> const& a, hash_trie<T> const& b ) -> bool {
+            return a.size()*2 < b.size();
+        }
+    }
+
+    // The values in either trie
+    template<typename T>
+    auto set_union( hash_trie<T> const& a, hash_trie<T> const& b ) -> hash_trie<T> {
+        auto const& larger = a.size() >= b.size() ? a : b;
+        auto const& smaller = a.size() >= b.size() ? b : a;
+        auto result = larger;
+        if( detail::much_smaller( smaller, larger ) ) {
+            for( auto const& value : hash_trie_view<T>( smaller ) )
+                result.insert( value );
+        }
+        else
+            diff( larger, smaller, [&]( T const& value ) { result.insert( value ); }, []( T const& ) {} );
+        return result;
+    }
+
+    // The values in both tries
+    template<typename T>
+    auto set_intersection( hash_trie<T> const& a, hash_trie<T> const& b ) -> hash_trie<T> {
+        auto const& larger = a.size() >= b.size() ? a : b;
+        auto const& smaller = a.size() >= b.size() ? b : a;
+        if( detail::much_smaller( smaller, larger ) ) {
+            hash_trie<T> result;
+            for( auto const& value : hash_trie_view<T>( smaller ) ) {
+                if( larger.contains( value ) )
+                    result.insert( value );
+            }
+            return result;
+        }
+        auto result = smaller;
+        diff( larger, smaller, [&]( T const& value ) { result.erase( value ); }, []( T const& ) {} );
+        return result;
+    }
+
+    // The values in a that are not in b
+    template<typename T>
+    auto set_difference( hash_trie<T> const& a, hash_trie<T> const& b ) -> hash_trie<T> {
+        if( detail::much_smaller( b, a ) ) {
+            auto result = a;
+            for( auto const& value : hash_trie_view<T>( b ) )
+                result.erase( value );
+            return result;
+        }
+        // The result starts from a: the subtrees a shares with b are dropped, and those that b
+        // has nothing alongside are kept as they are (diff() just counts what is left)
+        size_t size = 0;
+        diff( b, a, [&]( T const& ) { ++size; }, []( T const& ) {} );
+        if( size == a.size() )
+            return a;
+        if( size == 0 )
+            return {};
+        auto root = detail::trie_subtracter<T>( b.data().m_root ).subtracted( a.data().m_root, size );
+        hash_trie<T> result( hash_trie_data<T>{ root } );
+        release( root );
+        return result;
+    }
+
+    namespace detail {
+
+        using release_fn = void(*)( void const* );
+
+        template<typename T>
+        void release_root( void const* p ) {
+            release( static_cast<branch_node<T> const*>( p ) );
+        }
+
+        // Lock-free list of per-thread records, for the reclamation schemes below. Records are
+        // never freed - when a thread exits its record is marked inactive, for a later thread to reuse
+        template<typename Record>
+        class thread_records {
+            std::atomic<Record*> m_head { nullptr };
+
+        public:
+            auto first() const -> Record* {
+                return m_head.load( std::memory_order_acquire );
+            }
+
+            auto acquire() -> Record& {
+                for( auto record = first(); record; record = record->next ) {
+                    bool inactive = false;
+                    if( record->active.compare_exchange_strong( inactive, true, std::memory_order_acquire ) )
+                        return *record;
+                }
+                auto record = new Record;
+                record->active.store( true, std::memory_order_relaxed );
+                record->next = m_head.load( std::memory_order_relaxed );
+                while( !m_head.compare_exchange_weak( record->next, record,
+                                                      std::memory_order_release,
+                                                      std::memory_order_relaxed ) ) {}
+                return *record;
+            }
+        };
+
+        // The calling thread's record in Domain (given back when the thread exits)
+        template<typename Domain>
+        auto this_thread_record() -> typename Domain::record& {
+            struct owner {
+                typename Domain::record& record = Domain::instance().records().acquire();
+                ~owner() {
+                    Domain::instance().thread_exit( record );
+                    record.active.store( false, std::memory_order_release );
+                }
+            };
+            thread_local owner threadOwner;
+            return threadOwner.record;
+        }
+
+        struct retired_node {
+            void const* p;
+            release_fn release;
+            uint64_t epoch; // (only used by epoch_domain)
+        };
+
+        constexpr size_t hazardsPerThread = 4;
+
+        struct alignas(64) hazard_record { // (one per cache line, so readers don't contend)
+            std::atomic<node const*> hazards[hazardsPerThread] {};
+            uint32_t held = 0; // a bit per slot held by a read guard (only touched by the owning thread)
+            std::atomic<bool> active { false };
+            hazard_record* next = nullptr;
+        };
+
+        // Hazard pointers: before a reader uses a shared root it publishes the pointer in one of
+        // its thread's hazard slots, then checks the root is still current. A writer that replaces
+        // the root retires its reference to the old one, which is only released once no slot holds it
+        class hazard_domain {
+            thread_records<hazard_record> m_records;
+
+            std::mutex m_retiredMutex;
+            std::vector<retired_node> m_retired;
+            std::atomic<size_t> m_retiredCount { 0 };
+
+            auto is_hazard( void const* p ) const -> bool {
+                for( auto record = m_records.first(); record; record = record->next ) {
+                    for( auto const& hazard : record->hazards ) {
+                        if( hazard.load( std::memory_order_seq_cst ) == p )
+                            return true;
+                    }
+                }
+                return false;
+            }
+
+            // Releases any retired nodes that are no longer hazards
+            void reclaim() {
+                std::vector<retired_node> releasable;
+                {
+                    std::lock_guard<std::mutex> lock( m_retiredMutex );
+                    auto stillHazards = std::partition( m_retired.begin(), m_retired.end(),
+                            [this]( retired_node const& retired ) { return is_hazard( retired.p ); } );
+                    releasable.assign( stillHazards, m_retired.end() );
+                    m_retired.erase( stillHazards, m_retired.end() );
+                    m_retiredCount.store( m_retired.size(), std::memory_order_relaxed );
+                }
+                for( auto const& retired : releasable )
+                    retired.release( retired.p );
+            }
+
+        public:
+            using record = hazard_record;
+
+            ~hazard_domain() {
+                for( auto const& retired : m_retired )
+                    retired.release( retired.p );
+            }
+
+            static auto instance() -> hazard_domain& {
+                static hazard_domain domain;
+                return domain;
+            }
+            auto records() -> thread_records<hazard_record>& { return m_records; }
+
+            void thread_exit( hazard_record& record ) {
+                for( auto& hazard : record.hazards )
+                    hazard.store( nullptr, std::memory_order_relaxed );
+                record.held = 0;
+            }
+
+            // Loads root and publishes it in hazard, retrying until it is still current once published
+            template<typename NodeT>
+            static auto protect( std::atomic<node const*>& hazard, std::atomic<NodeT const*> const& root ) -> NodeT const* {
+                auto current = root.load( std::memory_order_acquire );
+                while( true ) {
+                    hazard.store( current, std::memory_order_seq_cst );
+                    auto validated = root.load( std::memory_order_seq_cst );
+                    if( validated == current )
+                        return current;
+                    current = validated;
+                }
+            }
+
+            // Gives up a reference to p, which may still be in use by readers that have
+            // published it as a hazard. release is called once that is no longer the case
+            void retire( void const* p, release_fn release ) {
+                if( !is_hazard( p ) )
+                    release( p );
+                else {
+                    std::lock_guard<std::mutex> lock( m_retiredMutex );
+                    m_retired.push_back( { p, release, 0 } );
+                    m_retiredCount.store( m_retired.size(), std::memory_order_relaxed );
+                    return;
+                }
+                if( m_retiredCount.load( std::memory_order_relaxed ) != 0 )
+                    reclaim();
+            }
+        };
+
+        struct alignas(64) epoch_record {
+            std::atomic<uint64_t> epoch { 0 }; // the epoch the thread is reading in, or 0 if it isn't
+            size_t depth = 0;
+            std::vector<retired_node> retired;
+            bool releasing = false; // (these three are only touched by the owning thread)
+            std::atomic<bool> active { false };
+            epoch_record* next = nullptr;
+        };
+
+        // Epoch based reclamation: readers announce the global epoch while they are reading, and
+        // the epoch only moves on once every reader has seen the current one. Anything retired in
+        // epoch e can be reached by readers in e or e+1 at most, so is released from e+2.
+        // Each thread keeps its own list of retired nodes, so retiring doesn't contend either
+        class epoch_domain {
+            static constexpr size_t retireBatch = 64; // retirements between attempts to release
+
+            std::atomic<uint64_t> m_epoch { 1 };
+            thread_records<epoch_record> m_records;
+
+            // Nodes retired by threads that have since exited, which are left for collect()
+            std::mutex m_orphansMutex;
+            std::vector<retired_node> m_orphans;
+            bool m_shuttingDown = false;
+
+            auto try_advance() -> uint64_t {
+                auto current = m_epoch.load( std::memory_order_seq_cst );
+                for( auto record = m_records.first(); record; record = record->next ) {
+                    auto epoch = record->epoch.load( std::memory_order_seq_cst );
+                    if( epoch != 0 && epoch != current )
+                        return current;
+                }
+                if( m_epoch.compare_exchange_strong( current, current+1, std::memory_order_seq_cst ) )
+                    return current+1;
+                return current;
+            }
+
+            // Releases everything in the record that was retired two or more epochs ago
+            void release_safe( epoch_record& record ) {
+                auto epoch = try_advance();
+                auto stillInUse = std::partition( record.retired.begin(), record.retired.end(),
+                        [epoch]( retired_node const& retired ) { return retired.epoch + 2 > epoch; } );
+                std::vector<retired_node> releasable( stillInUse, record.retired.end() );
+                record.retired.erase( stillInUse, record.retired.end() );
+
+                // (releasing may retire more, which just go on the list)
+                record.releasing = true;
+                for( auto const& retired : releasable )
+                    retired.release( retired.p );
+                record.releasing = false;
+            }
+
+        public:
+            using record = epoch_record;
+
+            ~epoch_domain() {
+                // No threads are reading by now, so anything released from here can go immediately
+                m_shuttingDown = true;
+                for( auto const& retired : m_orphans )
+                    retired.release( retired.p );
+            }
+
+            static auto instance() -> epoch_domain& {
+                static epoch_domain domain;
+                return domain;
+            }
+            auto records() -> thread_records<epoch_record>& { return m_records; }
+
+            void thread_exit( epoch_record& record ) {
+                record.epoch.store( 0, std::memory_order_relaxed );
+                record.depth = 0;
+                std::lock_guard<std::mutex> lock( m_orphansMutex );
+                m_orphans.insert( m_orphans.end(), record.retired.begin(), record.retired.end() );
+                record.retired.clear();
+            }
+
+            // Critical sections may nest. The announcement is a plain store to the thread's own
+            // record, so reading never writes to memory that other readers touch
+            void enter( epoch_record& record ) {
+                if( record.depth++ == 0 )
+                    record.epoch.store( m_epoch.load( std::memory_order_seq_cst ), std::memory_order_seq_cst );
+            }
+            void exit( epoch_record& record ) {
+                if( --record.depth == 0 )
+                    record.epoch.store( 0, std::memory_order_release );
+            }
+
+            void retire( void const* p, release_fn release ) {
+                if( m_shuttingDown )
+                    return release( p );
+                auto& record = this_thread_record<epoch_domain>();
+                record.retired.push_back( { p, release, m_epoch.load( std::memory_order_seq_cst ) } );
+                if( record.retired.size() >= retireBatch && !record.releasing )
+                    release_safe( record );
+            }
+
+            // Releases as much as possible, of what this thread (or exited threads) retired,
+            // without waiting for readers. Returns true if nothing is left retired
+            auto collect() -> bool {
+                auto& record = this_thread_record<epoch_domain>();
+                {
+                    std::lock_guard<std::mutex> lock( m_orphansMutex );
+                    record.retired.insert( record.retired.end(), m_orphans.begin(), m_orphans.end() );
+                    m_orphans.clear();
+                }
+                while( !record.retired.empty() ) {
+                    auto epoch = m_epoch.load( std::memory_order_seq_cst );
+                    release_safe( record );
+                    if( m_epoch.load( std::memory_order_seq_cst ) == epoch )
+                        break; // (held up by a reader)
+                }
+                return record.retired.empty();
+            }
+        };
+
+        // Picks a shard, from the top bits of a remixed hash. Values that would share a bitmap_node
+        // are kept in the same shard
+        inline auto shard_index( size_t hash, size_t bits ) -> size_t {
+            return bits == 0 ? 0 : static_cast<size_t>( rehash( hash & prefix_mask( maxDepth ) ) >> ( 64 - bits ) );
+        }
+
+        constexpr auto bits_for( size_t powerOfTwo ) -> size_t {
+            return powerOfTwo <= 1 ? 0 : 1 + bits_for( powerOfTwo / 2 );
+        }
+
+        // Keeps the calling thread in an epoch critical section while in scope
+        class epoch_guard {
+            epoch_record& m_record;
+
+        public:
+            epoch_guard( epoch_guard const& ) = delete;
+            epoch_guard& operator = ( epoch_guard const& ) = delete;
+
+            epoch_guard() : m_record( this_thread_record<epoch_domain>() ) {
+                epoch_domain::instance().enter( m_record );
+            }
+            ~epoch_guard() {
+                epoch_domain::instance().exit( m_record );
+            }
+        };
+
+    } // namespace detail
+
+    // Reclamation schemes for shared_hash_trie. These decide when a root that has been replaced by
+    // a commit can be released, given that other threads may still be reading it.
+    // Each provides: acquire(), which takes a reference to the current root; retire(), which gives
+    // up a reference to a replaced root; and read_guard, which keeps the current root alive while
+    // in scope *without* taking a reference to it
+
+    // The default. Readers publish the root they are about to use in a hazard pointer, which a
+    // writer checks before releasing. There is no global state, so a stalled reader can only ever
+    // hold up the roots it is using
+    struct hazard_pointer_reclamation {
+        template<typename NodeT>
+        static auto acquire( std::atomic<NodeT const*> const& root ) -> NodeT const* {
+            auto& record = detail::this_thread_record<detail::hazard_domain>();
+            auto& hazard = record.hazards[detail::hazardsPerThread-1]; // (never held by a read_guard)
+            auto current = detail::hazard_domain::protect( hazard, root );
+            addref( current );
+            hazard.store( nullptr, std::memory_order_release );
+            return current;
+        }
+
+        static void retire( node const* p, detail::release_fn release ) {
+            detail::hazard_domain::instance().retire( p, release );
+        }
+
+        template<typename T>
+        class read_guard {
+            detail::hazard_record& m_record;
+            std::atomic<node const*>* m_hazard = nullptr;
+            branch_node<T> const* m_root;
+
+        public:
+            read_guard( read_guard const& ) = delete;
+            read_guard& operator = ( read_guard const& ) = delete;
+
+            explicit read_guard( std::atomic<branch_node<T> const*> const& root )
+            :   m_record( detail::this_thread_record<detail::hazard_domain>() )
+            {
+                // Guards needn't be destroyed in the reverse order they were created in (e.g. a
+                // borrowed_snapshot can be held anywhere), so take whichever slot is free.
+                // The last slot is always left free for acquire()
+                for( size_t slot = 0; slot+1 < detail::hazardsPerThread; ++slot ) {
+                    auto bit = uint32_t(1) << slot;
+                    if( ( m_record.held & bit ) == 0 ) {
+                        m_record.held |= bit;
+                        m_hazard = &m_record.hazards[slot];
+                        break;
+                    }
+                }
+                if( m_hazard )
+                    m_root = detail::hazard_domain::protect( *m_hazard, root );
+                else // too many held at once to protect, so fall back to a reference
+                    m_root = acquire( root );
+            }
+            ~read_guard() {
+                if( m_hazard ) {
+                    m_hazard->store( nullptr, std::memory_order_release );
+                    m_record.held &= ~( uint32_t(1) << ( m_hazard - m_record.hazards ) );
+                }
+                else
+                    release( m_root );
+            }
+
+            auto root() const -> branch_node<T> const* { return m_root; }
+        };
+    };
+
+    // Readers announce an epoch instead of a pointer, so a read_guard is just a store to the
+    // thread's own record, however much is read under it. Replaced roots are released in batches
+    // once all readers have moved on - so a stalled reader holds up all reclamation
+    struct epoch_reclamation {
+        template<typename NodeT>
+        static auto acquire( std::atomic<NodeT const*> const& root ) -> NodeT const* {
+            detail::epoch_guard guard;
+            auto current = root.load( std::memory_order_seq_cst );
+            addref( current );
+            return current;
+        }
+
+        static void retire( node const* p, detail::release_fn release ) {
+            detail::epoch_domain::instance().retire( p, release );
+        }
+
+        // Releases anything retired by this thread (or by threads that have exited) that no reader
+        // can still see - otherwise that only happens in batches, on later commits.
+        // Returns true if there was nothing left
+        static auto collect() -> bool {
+            return detail::epoch_domain::instance().collect();
+        }
+
+        template<typename T>
+        class read_guard {
+            detail::epoch_guard m_guard;
+            branch_node<T> const* m_root;
+
+        public:
+            explicit read_guard( std::atomic<branch_node<T> const*> const& root )
+            :   m_root( root.load( std::memory_order_seq_cst ) )
+            {}
+
+            auto root() const -> branch_node<T> const* { return m_root; }
+        };
+    };
+
+    // Keeps the current root of a shared_hash_trie alive while in scope, without taking a reference
+    // to it. This is for short reads - it ties up reclamation (of that root, or for everyone, with
+    // epochs) for as long as it lives, and must be destroyed on the thread that created it
+    template<typename T, typename Reclamation>
+    class borrowed_snapshot {
+        typename Reclamation::template read_guard<T> m_guard;
+        hash_trie_view<T> m_view;
+
+    public:
+        explicit borrowed_snapshot( std::atomic<branch_node<T> const*> const& root )
+        :   m_guard( root ),
+            m_view( m_guard.root() )
+        {}
+
+        auto view() const -> hash_trie_view<T> const& { return m_view; }
+        auto operator -> () const -> hash_trie_view<T> const* { return &m_view; }
+    };
+
+    // How a transaction behaves while its commits keep failing under contention
+    struct contention_policy {
+        enum class backoff { none, yield, exponential };
+
+        backoff strategy = backoff::exponential;
+        size_t initialSpins = 16; // the first exponential backoff spins for up to this many pauses...
+        size_t maxSpins = 16 * 1024; // ...doubling with each failure, up to this many
+        size_t lockAfter = 8; // failures before queuing on the trie's (fair) commit lock - max() for never
+    };
+
+    // What update_with returned, and how much trouble it had committing
+    template<typename R>
+    struct update_result {
+        R result;
+        size_t attempts; // the number of times the task was run
+        bool queued; // whether it had to queue on the commit lock
+    };
+    template<>
+    struct update_result<void> {
+        size_t attempts;
+        bool queued;
+    };
+
+    namespace detail {
+        // A small, process-wide index for the calling thread, for spreading threads over slots
+        inline auto this_thread_index() -> size_t {
+            static std::atomic<size_t> s_nextIndex { 0 };
+            thread_local size_t index = s_nextIndex++;
+            return index;
+        }
+
+        inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+
+        // Waits a while before a transaction retries. Exponential backoff waits for a random
+        // part of the current limit, so writers that collided don't collide again in lockstep
+        inline void back_off( contention_policy const& policy, size_t& spins ) {
+            switch( policy.strategy ) {
+                case contention_policy::backoff::none:
+                    break;
+                case contention_policy::backoff::yield:
+                    std::this_thread::yield();
+                    break;
+                case contention_policy::backoff::exponential: {
+                    thread_local uint64_t random = rehash( this_thread_index() + 1 );
+                    random ^= random << 13;
+                    random ^= random >> 7;
+                    random ^= random << 17;
+                    for( auto i = random % ( spins + 1 ); i > 0; --i )
+                        cpu_relax();
+                    spins = std::min( spins * 2, policy.maxSpins );
+                    break;
+                }
+            }
+        }
+
+        // Raises value to at least minimum
+        inline void fetch_max( std::atomic<uint64_t>& value, uint64_t minimum ) {
+            auto current = value.load( std::memory_order_relaxed );
+            while( current < minimum &&
+                   !value.compare_exchange_weak( current, minimum, std::memory_order_seq_cst, std::memory_order_relaxed ) ) {}
+        }
+
+        // A fair lock - waiters are served in the order they arrived
+        class ticket_lock {
+            std::atomic<size_t> m_next { 0 };
+            std::atomic<size_t> m_serving { 0 };
+            std::atomic<std::thread::id> m_holder {}; // (only used to catch re-entry)
+
+        public:
+            void lock() {
+                assert( !held_by_this_thread() ); // (it would wait on itself forever)
+                auto ticket = m_next.fetch_add( 1, std::memory_order_relaxed );
+                while( m_serving.load( std::memory_order_acquire ) != ticket )
+                    std::this_thread::yield();
+                m_holder.store( std::this_thread::get_id(), std::memory_order_relaxed );
+            }
+            void unlock() {
+                m_holder.store( std::thread::id(), std::memory_order_relaxed );
+                m_serving.store( m_serving.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+            }
+
+            auto held_by_this_thread() const -> bool {
+                return m_holder.load( std::memory_order_relaxed ) == std::this_thread::get_id();
+            }
+
+            // Whether anyone holds, or is waiting for, the lock
+            auto is_contended() const -> bool {
+                return m_next.load( std::memory_order_relaxed ) != m_serving.load( std::memory_order_relaxed );
+            }
+        };
+    }
+
+    template<typename T, typename Reclamation>
+    class shared_hash_trie { // NOLINT
+        // The size is carried by the root itself, so only a single pointer needs to be atomic
+        static_assert( std::atomic<branch_node<T> const*>::is_always_lock_free,
+                       "the root pointer must be lock-free" );
+
+        std::atomic<branch_node<T> const*> m_root;
+        std::atomic<uint64_t> m_version; // the version of the latest root, raised after each successful commit
+        detail::ticket_lock m_commitLock; // for writers that keep failing to commit (see contention_policy)
+
+        // For wait_for_version_after. Commits only touch the mutex while someone is waiting
+        mutable std::atomic<size_t> m_waiters { 0 };
+        mutable std::mutex m_waitMutex;
+        mutable std::condition_variable m_versionChanged;
+
+        template<typename Wait>
+        auto wait_for_version( uint64_t version, Wait const& wait ) const -> uint64_t {
+            auto current = m_version.load( std::memory_order_acquire );
+            if( current != version )
+                return current;
+
+            // (seq_cst, with the raise in reset(), so that either we see the new version
+            // or the commit sees us waiting)
+            m_waiters.fetch_add( 1, std::memory_order_seq_cst );
+            {
+                std::unique_lock<std::mutex> lock( m_waitMutex );
+                wait( lock, [&] {
+                    current = m_version.load( std::memory_order_seq_cst );
+                    return current != version;
+                } );
+            }
+            m_waiters.fetch_sub( 1, std::memory_order_relaxed );
+            return current;
+        }
+
+        std::atomic<version_history<T, Reclamation>*> m_history { nullptr }; // if one is attached
+        std::atomic<size_t> m_recording { 0 }; // commits recording into m_history (so it isn't detached under them)
+
+        void record_history( uint64_t version, branch_node<T> const* root ) {
+            if( !m_history.load( std::memory_order_seq_cst ) )
+                return;
+            // (seq_cst, with the store and load in ~version_history, so either the history waits
+            // for this commit to finish with it, or this commit sees it has gone)
+            m_recording.fetch_add( 1, std::memory_order_seq_cst );
+            if( auto history = m_history.load( std::memory_order_seq_cst ) )
+                history->record( version, root );
+            m_recording.fetch_sub( 1, std::memory_order_seq_cst );
+        }
+
+        // A snapshot of another shared trie carries the version it had there, but this one starts from zero
+        static auto initial_root( hash_trie<T> const& hash_trie ) -> branch_node<T> const* {
+            auto root = hash_trie.data().m_root;
+            if( root->version() != 0 )
+                return root->cloned().release();
+            addref( root );
+            return root;
+        }
+
+        friend class hash_trie_transaction<T, Reclamation>;
+        friend class version_history<T, Reclamation>;
+
+    public:
+        using reclamation = Reclamation;
+
+        shared_hash_trie& operator = ( shared_hash_trie const& ) = delete;
+        shared_hash_trie& operator = ( shared_hash_trie&& ) = delete;
+
+        shared_hash_trie() noexcept : m_root( branch_node<T>::empty() ), m_version( 0 ) {}
+
+        explicit shared_hash_trie( hash_trie<T> const& hash_trie )
+        :   m_root( initial_root( hash_trie ) ),
+            m_version( 0 )
+        {}
+
+        ~shared_hash_trie() {
+            release( m_root.load( std::memory_order_acquire ) );
+        }
+
+        // The current root, *without* taking a reference to it. A concurrent commit may release
+        // it at any time, so it should only be compared, not dereferenced - use get() for that
+        auto data() const -> hash_trie_data<T> {
+            return { m_root.load( std::memory_order_acquire ) };
+        }
+
+        // A snapshot of the current trie
+        auto get() const -> hash_trie<T> {
+            hash_trie<T> snapshot;
+            snapshot.m_data.m_root = Reclamation::acquire( m_root );
+            return snapshot;
+        }
+
+        auto borrow() const -> borrowed_snapshot<T, Reclamation> {
+            return borrowed_snapshot<T, Reclamation>( m_root );
+        }
+
+        // Calls f with a view of the current trie. The view is only valid for the call, but
+        // no references are taken to read through it (so no atomic read-modify-writes)
+        template<typename F>
+        auto read( F const& f ) const -> decltype( f( std::declval<hash_trie_view<T>>() ) ) {
+            auto snapshot = borrow();
+            return f( snapshot.view() );
+        }
+
+        // Changes whenever a commit succeeds. The new root may be visible slightly before the
+        // version changes, but never after
+        auto version() const -> uint64_t {
+            return m_version.load( std::memory_order_acquire );
+        }
+
+        // Blocks until a commit moves the version on from the one given (e.g. the last one seen),
+        // rather than polling for it, and returns the new version
+        auto wait_for_version_after( uint64_t version ) const -> uint64_t {
+            return wait_for_version( version, [this]( auto& lock, auto const& changed ) {
+                m_versionChanged.wait( lock, changed );
+            } );
+        }
+
+        // As above, but gives up after the timeout - in which case it returns the version given
+        template<typename Rep, typename Period>
+        auto wait_for_version_after( uint64_t version, std::chrono::duration<Rep, Period> const& timeout ) const -> uint64_t {
+            return wait_for_version( version, [this, &timeout]( auto& lock, auto const& changed ) {
+                m_versionChanged.wait_for( lock, timeout, changed );
+            } );
+        }
+
+        auto start_transaction() -> hash_trie_transaction<T, Reclamation>;
+
+        template<typename L>
+        auto update_with( L const& updateTask, contention_policy const& policy = {} );
+
+        // "low level" compare-exchange wrapper - use transaction.
+        // On failure originalData is updated to the current root (again, without a reference).
+        // newData must hold a reference to its root, which may be replaced by a copy (see below)
+        auto reset( hash_trie_data<T>& originalData,
+                    hash_trie_data<T>& newData ) -> bool {
+            // The new root carries its version, set before the compare-exchange publishes it - so
+            // a successful commit fixes the order of the versions by itself. That needs a root no one
+            // else can see yet, which it nearly always is (having just been made by the caller's
+            // changes), but otherwise it is copied (sharing all its children) first
+            if( newData.m_root->m_immortal || newData.m_root->m_refCount.load( std::memory_order_acquire ) != 1 ) {
+                auto copy = newData.m_root->cloned().release();
+                release( newData.m_root );
+                newData.m_root = copy;
+            }
+            auto version = originalData.m_root->m_version + 1;
+            const_cast<branch_node<T>*>( newData.m_root )->m_version = version; // NOLINT
+
+            addref( newData.m_root );
+            if( !m_root.compare_exchange_strong
+                    ( originalData.m_root, newData.m_root,
+                      std::memory_order_seq_cst,
+                      std::memory_order_acquire ) ) {
+                release( newData.m_root );
+                return false;
+            }
+
+            // (a later commit may have got in, and raised it further, already)
+            detail::fetch_max( m_version, version );
+            record_history( version, newData.m_root );
+            if( m_waiters.load( std::memory_order_seq_cst ) != 0 ) {
+                // (taking the lock means a waiter is either yet to check the version, or asleep)
+                { std::lock_guard<std::mutex> lock( m_waitMutex ); }
+                m_versionChanged.notify_all();
+            }
+            Reclamation::retire( originalData.m_root, &detail::release_root<T> );
+            return true;
+        }
+
+        auto is_lock_free() const { return m_root.is_lock_free(); }
+    };
+
+    template<typename T, typename Reclamation>
+    class hash_trie_transaction {
+        enum class operation { insert, erase };
+
+        hash_trie<T> m_base; // the snapshot that commits are compare-exchanged against
+        shared_hash_trie<T, Reclamation>& m_shared;
+
+        // Changes made through the transaction itself are recorded, along with anything they
+        // depended on, so that if another commit gets in first they can be replayed onto it
+        hash_trie<T> m_working; // m_base, with the recorded writes applied (once anything is recorded)
+        bool m_recording = false;
+        std::vector<std::pair<operation, T>> m_writes;
+        hash_trie<T> m_written; // (values in m_writes, so reads of them needn't be recorded)
+        std::vector<T> m_reads;
+        bool m_readSize = false;
+
+        auto working() -> hash_trie<T>& {
+            if( !m_recording ) {
+                m_working = m_base;
+                m_recording = true;
+            }
+            return m_working;
+        }
+
+        void clear_recording() {
+            m_working.clear();
+            m_recording = false;
+            m_writes.clear();
+            m_written.clear();
+            m_reads.clear();
+            m_readSize = false;
+        }
+
+        void record_write( operation op, T const& value ) {
+            m_writes.emplace_back( op, value );
+            m_written.insert( value );
+        }
+
+        // Whether anything read by the transaction has been changed by the commits between bases
+        auto reads_conflict( hash_trie<T> const& oldBase, hash_trie<T> const& newBase ) const -> bool {
+            if( m_readSize && oldBase.size() != newBase.size() )
+                return true;
+            return std::any_of( m_reads.begin(), m_reads.end(), [&]( T const& value ) {
+                return oldBase.contains( value ) != newBase.contains( value );
+            } );
+        }
+
+    public:
+        explicit hash_trie_transaction( shared_hash_trie<T, Reclamation>& shared )
+        : m_base( shared.get() ),
+          m_shared( shared )
+        {}
+
+        auto get() const -> hash_trie<T> {
+            return m_base;
+        }
+
+        // If the commit fails the transaction is rebased onto the current trie
+        auto try_commit(hash_trie<T> &newHashTrie) -> bool {
+            auto baseData = m_base.data();
+            if( m_shared.reset( baseData, newHashTrie.data() ) ) {
+                m_base = newHashTrie;
+                clear_recording();
+                return true;
+            }
+            m_base = m_shared.get();
+            clear_recording();
+            return false;
+        }
+
+        // Recorded operations. Writes don't report whether they changed anything, as that would
+        // be a read of the value, too - use contains() for that
+        template<typename U>
+        void insert( U&& value ) {
+            T stored( std::forward<U>( value ) );
+            working().insert( stored );
+            record_write( operation::insert, stored );
+        }
+        void erase( T const& value ) {
+            working().erase( value );
+            record_write( operation::erase, value );
+        }
+        auto contains( typename detail::lookup_key<T>::type const& value ) -> bool {
+            if( !m_written.contains( value ) )
+                m_reads.emplace_back( value );
+            return working().contains( value );
+        }
+        auto size() -> size_t {
+            m_readSize = true;
+            return working().size();
+        }
+
+        // Commits the recorded operations. If another commit got in first, and changed nothing
+        // that was read, the writes are replayed onto it (re-using its nodes, and leaving the
+        // caller's code alone) and the commit tried again. Otherwise returns false, with the
+        // transaction rebased onto the current trie and its recording cleared, to start again
+        auto try_commit() -> bool {
+            while( m_recording ) {
+                if( m_working.data().m_root == m_base.data().m_root ) {
+                    // The writes made no difference to this base - but they might to a newer one
+                    if( m_writes.empty() || m_shared.data().m_root == m_base.data().m_root )
+                        break;
+                }
+                else {
+                    auto baseData = m_base.data();
+                    if( m_shared.reset( baseData, m_working.data() ) ) {
+                        m_base = m_working;
+                        break;
+                    }
+                }
+                auto newBase = m_shared.get();
+                if( reads_conflict( m_base, newBase ) ) {
+                    m_base = std::move( newBase );
+                    clear_recording();
+                    return false;
+                }
+                m_working = newBase;
+                for( auto const& write : m_writes ) {
+                    if( write.first == operation::insert )
+                        m_working.insert( write.second );
+                    else
+                        m_working.erase( write.second );
+                }
+                m_base = std::move( newBase );
+            }
+            clear_recording();
+            return true;
+        }
+
+        // updateTask is either given a copy of the trie to change, and re-run whenever the commit
+        // fails, or the transaction itself, to record its operations on - and is then only re-run
+        // if something it read changed. Between attempts it backs off, as the policy says, and
+        // after policy.lockAfter failures it queues on the commit lock. While anyone is queued
+        // there, other writers that have failed queue too, and first attempts wait for the queue
+        // to empty - so a writer can't be starved by faster ones, but when nobody is queued a
+        // first attempt doesn't touch the lock. A queued updateTask can itself update the same
+        // trie: that inner update neither waits nor queues (it would be waiting on itself).
+        // Returns what updateTask returned (from the attempt that committed), and how it went
+        template<typename L>
+        auto update_with( L const& updateTask, contention_policy const& policy = {} ) {
+            constexpr bool recorded = std::is_invocable_v<L const&, hash_trie_transaction&>;
+            using task_argument = std::conditional_t<recorded, hash_trie_transaction&, hash_trie<T>&>;
+            using result_type = std::invoke_result_t<L const&, task_argument>;
+
+            std::optional<std::conditional_t<std::is_void_v<result_type>, bool, result_type>> taskResult;
+            auto run = [&]( task_argument argument ) {
+                if constexpr( std::is_void_v<result_type> ) {
+                    updateTask( argument );
+                    taskResult.emplace( true );
+                }
+                else
+                    taskResult.emplace( updateTask( argument ) );
+            };
+
+            auto& commitLock = m_shared.m_commitLock;
+            std::unique_lock<detail::ticket_lock> queued( commitLock, std::defer_lock );
+            size_t spins = policy.initialSpins;
+            size_t attempts = 0;
+            while( true ) {
+                if( !queued.owns_lock() && !commitLock.held_by_this_thread() ) {
+                    if( attempts >= policy.lockAfter || ( attempts > 0 && commitLock.is_contended() ) )
+                        queued.lock();
+                    else if( commitLock.is_contended() ) {
+                        while( commitLock.is_contended() )
+                            std::this_thread::yield();
+                        if( !m_recording ) // (the trie has most likely moved on while waiting)
+                            m_base = m_shared.get();
+                    }
+                }
+                ++attempts;
+
+                bool committed;
+                if constexpr( recorded ) {
+                    run( *this );
+                    committed = try_commit();
+                }
+                else {
+                    hash_trie<T> copy( m_base );
+                    run( copy );
+
+                    // If we didn't change, don't do anything - otherwise m_base is updated with the
+                    // new base if the commit fails
+                    committed = copy.data().m_root == m_base.data().m_root || try_commit( copy );
+                }
+                if( committed )
+                    break;
+                if( !queued.owns_lock() )
+                    detail::back_off( policy, spins );
+            }
+
+            if constexpr( std::is_void_v<result_type> )
+                return update_result<void>{ attempts, queued.owns_lock() };
+            else
+                return update_result<result_type>{ std::move( *taskResult ), attempts, queued.owns_lock() };
+        }
+    };
+
+    // Keeps the roots of the most recent commits to a shared_hash_trie, so that earlier versions of
+    // it can still be read (e.g. for audit, or a long scan that must be consistent with other reads).
+    // As versions share most of their nodes, retaining one is just keeping a reference to its root,
+    // which only keeps alive the nodes that have since been replaced - see retained_bytes().
+    // The last capacity versions are kept in a ring buffer, and, if maxAge is given, any that were
+    // replaced longer ago than that are dropped at the next commit (or trim()).
+    // Neither reads nor commits take locks. Each commit records itself in the slot for its version
+    // (which its root carries, so is fixed by the commit itself), and latest_version() only moves
+    // on once every version up to it has been recorded - whatever order the commits got there in.
+    // Only one history (or change_feed) can be attached to a trie at a time, but it can be
+    // attached, and detached, while other threads are committing to it
+    template<typename T, typename Reclamation>
+    class version_history {
+    public:
+        using clock = std::chrono::steady_clock;
+
+    private:
+        // What a slot's version is while it holds none, or is being replaced
+        static constexpr uint64_t noVersion = ~uint64_t(0);
+        static constexpr uint64_t replacing = noVersion - 1;
+
+        struct alignas(64) slot { // (one per cache line, so readers don't contend with the next commit)
+            std::atomic<uint64_t> version { noVersion }; // the version held here
+            std::atomic<clock::rep> committed { 0 }; // when
+            std::atomic<branch_node<T> const*> root { branch_node<T>::empty() };
+        };
+
+        shared_hash_trie<T, Reclamation>& m_shared;
+        std::unique_ptr<slot[]> m_slots;
+        size_t m_capacity;
+        clock::duration m_maxAge;
+        std::atomic<uint64_t> m_oldest; // the oldest version still held
+        std::atomic<uint64_t> m_latest; // the latest version that it, and all before it, have been recorded
+
+        friend class shared_hash_trie<T, Reclamation>;
+
+        // Marks a slot as being replaced, if what it holds satisfies canReplace. If another thread
+        // is replacing it already (e.g. a commit a whole ring later), waits for that to finish first
+        template<typename F>
+        static auto claim( slot& entry, F const& canReplace ) -> bool {
+            auto held = entry.version.load( std::memory_order_seq_cst );
+            while( true ) {
+                if( held == replacing ) {
+                    std::this_thread::yield();
+                    held = entry.version.load( std::memory_order_seq_cst );
+                }
+                else if( !canReplace( held ) )
+                    return false;
+                else if( entry.version.compare_exchange_weak( held, replacing, std::memory_order_seq_cst ) )
+                    return true;
+            }
+        }
+
+        // Fills a claimed slot, publishing the version last
+        static void fill( slot& entry, uint64_t version, clock::time_point committed, branch_node<T> const* root ) {
+            addref( root );
+            entry.committed.store( committed.time_since_epoch().count(), std::memory_order_seq_cst );
+            auto replaced = entry.root.exchange( root, std::memory_order_seq_cst );
+            entry.version.store( version, std::memory_order_seq_cst );
+            Reclamation::retire( replaced, &detail::release_root<T> );
+        }
+
+        // Called by shared_hash_trie::reset() after each commit - perhaps by several threads at once
+        void record( uint64_t version, branch_node<T> const* root ) {
+            auto now = clock::now();
+            auto& entry = m_slots[version % m_capacity];
+            // (unless a commit a whole ring later has got there first)
+            if( claim( entry, [version]( uint64_t held ) { return held == noVersion || held < version; } ) )
+                fill( entry, version, now, root );
+            if( version >= m_capacity )
+                detail::fetch_max( m_oldest, version - m_capacity + 1 );
+            advance_latest();
+            drop_expired( now );
+        }
+
+        // Moves m_latest on over each version after it that has been recorded (or already replaced
+        // by a later one). Whichever commit records the one it stopped at carries it on from there
+        void advance_latest() {
+            auto latest = m_latest.load( std::memory_order_seq_cst );
+            while( true ) {
+                auto held = m_slots[( latest+1 ) % m_capacity].version.load( std::memory_order_seq_cst );
+                if( held == noVersion || held == replacing || held <= latest )
+                    return;
+                if( m_latest.compare_exchange_weak( latest, latest+1, std::memory_order_seq_cst ) )
+                    ++latest;
+            }
+        }
+
+        // A version expires once the one after it is older than maxAge (so the latest never does)
+        void drop_expired( clock::time_point now ) {
+            auto oldest = m_oldest.load( std::memory_order_seq_cst );
+            while( oldest < m_latest.load( std::memory_order_seq_cst ) ) {
+                clock::rep replacedAt = 0;
+                if( !read_slot( oldest+1, [&]( slot const& entry ) {
+                        replacedAt = entry.committed.load( std::memory_order_seq_cst );
+                    } ) )
+                    return; // (it has moved on since)
+                if( now - clock::time_point( clock::duration( replacedAt ) ) <= m_maxAge )
+                    return;
+                // (readers check the version after the oldest, so it moves on first)
+                if( m_oldest.compare_exchange_strong( oldest, oldest+1, std::memory_order_seq_cst ) ) {
+                    auto& entry = m_slots[oldest % m_capacity];
+                    if( claim( entry, [oldest]( uint64_t held ) { return held == oldest; } ) )
+                        fill( entry, noVersion, clock::time_point(), branch_node<T>::empty() );
+                    ++oldest;
+                }
+            }
+        }
+
+        // Reads a slot as of a version, if it still holds it
+        template<typename F>
+        auto read_slot( uint64_t version, F const& read ) const -> bool {
+            auto const& entry = m_slots[version % m_capacity];
+            if( entry.version.load( std::memory_order_seq_cst ) != version )
+                return false;
+            read( entry );
+            // (if the version is unchanged, so is the rest - it is only replaced between the version stores)
+            return entry.version.load( std::memory_order_seq_cst ) == version;
+        }
+
+    public:
+        explicit version_history( shared_hash_trie<T, Reclamation>& shared, size_t capacity = 1024,
+                                  clock::duration maxAge = clock::duration::max() )
+        :   m_shared( shared ),
+            m_slots( new slot[capacity] ),
+            m_capacity( capacity ),
+            m_maxAge( maxAge )
+        {
+            assert( capacity > 0 );
+            // Every commit after the current root records itself, once it sees this attached. Those
+            // before it are never recorded - so latest_version() mustn't wait for them
+            auto version = shared.version();
+            m_oldest.store( version );
+            m_latest.store( version );
+            version_history* attached = nullptr;
+            shared.m_history.compare_exchange_strong( attached, this, std::memory_order_seq_cst );
+            assert( !attached ); // (only one at a time)
+
+            auto current = shared.get();
+            auto currentVersion = current.data().m_root->version();
+            record( currentVersion, current.data().m_root );
+            detail::fetch_max( m_oldest, currentVersion );
+            detail::fetch_max( m_latest, currentVersion );
+            advance_latest();
+        }
+
+        version_history( version_history const& ) = delete;
+        version_history& operator = ( version_history const& ) = delete;
+
+        ~version_history() {
+            m_shared.m_history.store( nullptr, std::memory_order_seq_cst );
+            while( m_shared.m_recording.load( std::memory_order_seq_cst ) != 0 )
+                std::this_thread::yield();
+            for( size_t i = 0; i < m_capacity; ++i )
+                release( m_slots[i].root.load( std::memory_order_acquire ) );
+        }
+
+        auto oldest_version() const -> uint64_t { return m_oldest.load( std::memory_order_seq_cst ); }
+        auto latest_version() const -> uint64_t { return m_latest.load( std::memory_order_seq_cst ); }
+
+        // The trie as it was at the given version, if that is still held
+        auto get_at_version( uint64_t version ) const -> std::optional<hash_trie<T>> {
+            hash_trie<T> trie;
+            if( version < oldest_version() || !read_slot( version, [&]( slot const& entry ) {
+                    trie.m_data.m_root = Reclamation::acquire( entry.root );
+                } ) )
+                return std::nullopt;
+            return trie;
+        }
+
+        // The trie as it was at the given time - i.e. the latest version committed by then - if
+        // that is still held
+        auto get_at_time( clock::time_point time ) const -> std::optional<hash_trie<T>> {
+            for( auto version = latest_version(); version >= oldest_version(); --version ) {
+                clock::rep committed = 0;
+                if( !read_slot( version, [&]( slot const& entry ) {
+                        committed = entry.committed.load( std::memory_order_seq_cst );
+                    } ) )
+                    break; // (it has been replaced since we started, so anything older has, too)
+                if( clock::time_point( clock::duration( committed ) ) <= time )
+                    return get_at_version( version );
+                if( version == 0 )
+                    break;
+            }
+            return std::nullopt;
+        }
+
+        // Drops versions older than maxAge without waiting for the next commit
+        void trim() {
+            drop_expired( clock::now() );
+        }
+
+        // The memory held by the history itself: the nodes of each version held that are no
+        // longer in the version after it (or the current trie, for the latest). Shared subtrees
+        // are skipped, so this takes time in proportion to the changes made, not the size of the trie
+        auto retained_bytes() const -> size_t {
+            size_t bytes = 0;
+            auto newer = m_shared.get();
+            for( auto version = latest_version(); version >= oldest_version(); --version ) {
+                auto older = get_at_version( version );
+                if( !older )
+                    break;
+                bytes += detail::unshared_bytes( older->data().m_root, newer.data().m_root );
+                newer = std::move( *older );
+                if( version == 0 )
+                    break;
+            }
+            return bytes;
+        }
+    };
+
+    // A feed of the commits to a shared_hash_trie, for subscribers to follow at their own pace
+    // (e.g. to replicate the trie, or invalidate caches). The commits are kept in a version_history
+    // and each subscriber works out what one changed by diffing it against the last version it saw -
+    // so only the parts that changed are visited. Subscribers don't take locks, or hold up commits
+    template<typename T, typename Reclamation>
+    class change_feed {
+        version_history<T, Reclamation> m_history;
+
+    public:
+        class subscriber {
+            version_history<T, Reclamation> const& m_history;
+            hash_trie<T> m_seen;
+            uint64_t m_version;
+
+        public:
+            explicit subscriber( change_feed const& feed ) : m_history( feed.m_history ) {
+                while( true ) {
+                    m_version = m_history.latest_version();
+                    if( auto seen = m_history.get_at_version( m_version ) ) {
+                        m_seen = std::move( *seen );
+                        break;
+                    }
+                }
+            }
+
+            // The last version seen, and the trie as of that version
+            auto version() const -> uint64_t { return m_version; }
+            auto snapshot() const -> hash_trie<T> const& { return m_seen; }
+
+            // Reports the values added and removed by the next commit not yet seen, and returns the
+            // number of versions moved on by. That is usually one (or zero if there are no new
+            // commits), but a subscriber that has fallen so far behind that the next commit has
+            // left the feed catches up with the latest one, reporting all the changes since in one go
+            template<typename Added, typename Removed>
+            auto next( Added const& onAdded, Removed const& onRemoved ) -> uint64_t {
+                auto version = m_version + 1;
+                auto next = m_history.get_at_version( version );
+                while( !next ) {
+                    version = m_history.latest_version();
+                    if( version <= m_version )
+                        return 0;
+                    next = m_history.get_at_version( version );
+                }
+                diff( m_seen, *next, onAdded, onRemoved );
+                m_seen = std::move( *next );
+                return version - std::exchange( m_version, version );
+            }
+        };
+
+        explicit change_feed( shared_hash_trie<T, Reclamation>& shared, size_t capacity = 1024 )
+        :   m_history( shared, capacity )
+        {}
+
+        auto subscribe() const -> subscriber { return subscriber( *this ); }
+
+        auto history() const -> version_history<T, Reclamation> const& { return m_history; }
+    };
+
+    // Holds on to a snapshot of a shared_hash_trie until its version changes, so a thread that
+    // reads far more often than the trie is written only touches the root's ref count once per
+    // commit, rather than once per read. Intended to be kept per-thread (e.g. thread_local).
+    // Note that the cached snapshot keeps its version alive until the next get() after a commit
+    template<typename T, typename Reclamation = hazard_pointer_reclamation>
+    class snapshot_cache {
+        shared_hash_trie<T, Reclamation> const& m_shared;
+        hash_trie<T> m_snapshot;
+        uint64_t m_version;
+
+    public:
+        explicit snapshot_cache( shared_hash_trie<T, Reclamation> const& shared )
+        :   m_shared( shared ),
+            m_version( shared.version() )
+        {
+            m_snapshot = shared.get();
+        }
+
+        // The snapshot is only replaced by later calls to get(), so the reference stays valid until then
+        auto get() -> hash_trie<T> const& {
+            auto version = m_shared.version();
+            if( version != m_version ) {
+                // (the version is read first, so the snapshot is at least that new)
+                m_snapshot = m_shared.get();
+                m_version = version;
+            }
+            return m_snapshot;
+        }
+    };
+
+    // Flat combining for a shared_hash_trie with many writers of single values. Rather than each
+    // thread path-copying its own new version and racing to commit it (with the losers starting
+    // again), threads publish their operation in a slot, and whichever thread takes the combiner
+    // lock applies every pending operation to one copy and commits that, for all of them.
+    // Other writers (e.g. update_with) can still commit directly, and the combiner retries past them
+    template<typename T, typename Reclamation = hazard_pointer_reclamation>
+    class hash_trie_combiner {
+        static constexpr size_t slotCount = 64;
+
+        enum slot_state { free, claimed, pending, done };
+        enum class operation { insert, erase };
+
+        struct alignas(64) slot {
+            std::atomic<int> state { free };
+            operation op;
+            T const* value;
+            bool result = false;
+            std::exception_ptr error; // set, instead of result, if the operation threw
+        };
+
+        shared_hash_trie<T, Reclamation>& m_shared;
+        std::atomic<bool> m_combining { false };
+        slot m_slots[slotCount];
+
+        auto claim_slot() -> slot& {
+            for( auto index = detail::this_thread_index();; ++index ) {
+                auto& candidate = m_slots[index % slotCount];
+                int expected = free;
+                if( candidate.state.load( std::memory_order_relaxed ) == free &&
+                    candidate.state.compare_exchange_strong( expected, claimed, std::memory_order_acquire ) )
+                    return candidate;
+                if( ( index+1 ) % slotCount == 0 ) // (all taken, so let their owners finish with them)
+                    std::this_thread::yield();
+            }
+        }
+
+        // Applies every pending operation, as one commit
+        void combine() {
+            slot* batch[slotCount];
+            size_t batchSize = 0;
+            for( auto& candidate : m_slots ) {
+                if( candidate.state.load( std::memory_order_acquire ) == pending )
+                    batch[batchSize++] = &candidate;
+            }
+
+            try {
+                auto transaction = m_shared.start_transaction();
+                while( true ) {
+                    auto updated = transaction.get();
+                    for( size_t i = 0; i < batchSize; ++i ) {
+                        // An operation that throws leaves the trie as it was (inserts and erases
+                        // only replace the root once they have succeeded), so just that one fails
+                        auto& op = *batch[i];
+                        op.result = false;
+                        op.error = nullptr;
+                        try {
+                            if( op.op == operation::insert ) {
+                                auto size = updated.size();
+                                updated.insert( *op.value );
+                                op.result = updated.size() != size;
+                            }
+                            else
+                                op.result = updated.erase( *op.value );
+                        }
+                        catch( ... ) {
+                            op.error = std::current_exception();
+                        }
+                    }
+                    if( updated.data().m_root == transaction.get().data().m_root || transaction.try_commit( updated ) )
+                        break;
+                }
+            }
+            catch( ... ) {
+                // (nothing was committed, so the whole batch failed)
+                for( size_t i = 0; i < batchSize; ++i )
+                    batch[i]->error = std::current_exception();
+            }
+            for( size_t i = 0; i < batchSize; ++i )
+                batch[i]->state.store( done, std::memory_order_release );
+        }
+
+        auto apply( operation op, T const& value ) -> bool {
+            auto& mySlot = claim_slot();
+            mySlot.op = op;
+            mySlot.value = &value;
+            mySlot.state.store( pending, std::memory_order_release );
+
+            while( mySlot.state.load( std::memory_order_acquire ) != done ) {
+                bool combining = false;
+                if( !m_combining.load( std::memory_order_relaxed ) &&
+                    m_combining.compare_exchange_strong( combining, true, std::memory_order_acquire ) ) {
+                    struct combining_guard {
+                        std::atomic<bool>& combining;
+                        ~combining_guard() { combining.store( false, std::memory_order_release ); }
+                    } guard { m_combining };
+                    combine();
+                }
+                else
+                    std::this_thread::yield();
+            }
+            auto result = mySlot.result;
+            auto error = std::move( mySlot.error );
+            mySlot.error = nullptr;
+            mySlot.state.store( free, std::memory_order_release );
+            if( error )
+                std::rethrow_exception( error );
+            return result;
+        }
+
+    public:
+        explicit hash_trie_combiner( shared_hash_trie<T, Reclamation>& shared ) : m_shared( shared ) {}
+
+        // Returns true if the value was inserted (i.e. was not already present)
+        auto insert( T const& value ) -> bool { return apply( operation::insert, value ); }
+
+        // Returns true if the value was present
+        auto erase( T const& value ) -> bool { return apply( operation::erase, value ); }
+    };
+
+    template<typename T, typename Reclamation>
+    auto shared_hash_trie<T, Reclamation>::start_transaction() -> hash_trie_transaction<T, Reclamation> {
+        return hash_trie_transaction<T, Reclamation>( *this );
+    }
+    template<typename T, typename Reclamation>
+    template<typename L>
+    auto shared_hash_trie<T, Reclamation>::update_with( L const& updateTask, contention_policy const& policy ) {
+        auto trans = start_transaction();
+        return trans.update_with( updateTask, policy );
+    }
+
+
+    // Executors for async_committer. Any type with an execute( task ) that (eventually) calls
+    // task() can be used instead - e.g. one that posts to an event loop
+
+    // Runs each task on the calling thread, as it is submitted
+    struct inline_executor {
+        template<typename F>
+        void execute( F&& task ) { task(); }
+    };
+
+    // Runs tasks on a fixed number of threads of its own - in the order they were submitted,
+    // though with more than one thread, they can finish in any order
+    class thread_pool_executor {
+        std::mutex m_mutex;
+        std::condition_variable m_hasTasks;
+        std::deque<std::function<void()>> m_tasks;
+        bool m_stopping = false;
+        std::vector<std::thread> m_threads;
+
+        void run() {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            while( true ) {
+                m_hasTasks.wait( lock, [this] { return m_stopping || !m_tasks.empty(); } );
+                if( m_tasks.empty() )
+                    return;
+                auto task = std::move( m_tasks.front() );
+                m_tasks.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+
+    public:
+        explicit thread_pool_executor( size_t threadCount = std::max( std::thread::hardware_concurrency(), 1u ) ) {
+            for( size_t i = 0; i < threadCount; ++i )
+                m_threads.emplace_back( [this] { run(); } );
+        }
+        thread_pool_executor( thread_pool_executor const& ) = delete;
+        thread_pool_executor& operator = ( thread_pool_executor const& ) = delete;
+
+        // Runs any tasks still queued first
+        ~thread_pool_executor() {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                m_stopping = true;
+            }
+            m_hasTasks.notify_all();
+            for( auto& thread : m_threads )
+                thread.join();
+        }
+
+        void execute( std::function<void()> task ) {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                m_tasks.push_back( std::move( task ) );
+            }
+            m_hasTasks.notify_one();
+        }
+    };
+
+    // Runs tasks, in order, on a thread of its own
+    class thread_executor : public thread_pool_executor {
+    public:
+        thread_executor() : thread_pool_executor( 1 ) {}
+    };
+
+    namespace detail {
+        // Waits for a number of tasks handed to an executor, and holds the first exception any threw
+        class task_latch {
+            std::mutex m_mutex;
+            std::condition_variable m_done;
+            size_t m_pending = 0;
+            std::exception_ptr m_error;
+
+        public:
+            template<typename Executor, typename F>
+            void execute( Executor& executor, F task ) {
+                {
+                    std::lock_guard<std::mutex> lock( m_mutex );
+                    ++m_pending;
+                }
+                executor.execute( [this, task = std::move( task )]() mutable {
+                    std::exception_ptr error;
+                    try {
+                        task();
+                    }
+                    catch( ... ) {
+                        error = std::current_exception();
+                    }
+                    std::lock_guard<std::mutex> lock( m_mutex );
+                    if( error && !m_error )
+                        m_error = error;
+                    if( --m_pending == 0 )
+                        m_done.notify_all();
+                } );
+            }
+
+            // Waits for all the tasks, then rethrows the first exception, if any of them threw
+            void wait() {
+                std::unique_lock<std::mutex> lock( m_mutex );
+                m_done.wait( lock, [this] { return m_pending == 0; } );
+                if( m_error )
+                    std::rethrow_exception( m_error );
+            }
+        };
+    }
+
+    // The input is split into pieces, and each piece is built concurrently into a trie per root
+    // chunk of its values' hashes (so each value is hashed just once). Then the pieces' tries for
+    // each root chunk are merged concurrently - sharing their subtrees wherever they don't overlap -
+    // and, as every value in them shares that chunk, so each root has just the one child, those
+    // children are stitched together under a single new root. The executor must be able to run
+    // tasks while the calling thread waits for them (so not be one whose only thread is the caller's)
+    template<typename T>
+    template<typename It, typename Executor>
+    auto hash_trie<T>::parallel_from_range( It first, It last, Executor& executor ) -> hash_trie {
+        constexpr size_t rootChunks = size_t(1) << detail::bitsPerChunk;
+        constexpr size_t minPieceSize = 16*1024;
+        constexpr size_t maxPieces = 64;
+
+        auto total = static_cast<size_t>( std::distance( first, last ) );
+        auto pieceCount = std::max( std::min( total / minPieceSize, maxPieces ), size_t(1) );
+
+        std::vector<std::array<hash_trie, rootChunks>> pieces( pieceCount );
+        detail::task_latch latch;
+        for( size_t piece = 0; piece < pieceCount; ++piece ) {
+            auto pieceFirst = std::next( first, static_cast<std::ptrdiff_t>( total * piece / pieceCount ) );
+            auto pieceLast = std::next( first, static_cast<std::ptrdiff_t>( total * (piece+1) / pieceCount ) );
+            latch.execute( executor, [pieceFirst, pieceLast, &subtries = pieces[piece]] {
+                for( auto it = pieceFirst; it != pieceLast; ++it ) {
+                    T const& value = *it;
+                    detail::chunked_hash chunkedHash( detail::hash_of( value ) );
+                    auto& subtrie = subtries[chunkedHash.chunk];
+                    if( auto newRoot = inserted_at( path<T>( chunkedHash, subtrie.m_data.m_root ), value ) )
+                        subtrie.set_root( newRoot, subtrie.size()+1 );
+                }
+            } );
+        }
+        latch.wait();
+
+        // (so the merging is spread over no more than rootChunks tasks)
+        std::array<hash_trie, rootChunks> subtries;
+        for( size_t chunk = 0; chunk < rootChunks; ++chunk ) {
+            latch.execute( executor, [chunk, &pieces, &subtrie = subtries[chunk]] {
+                for( auto& piece : pieces ) {
+                    auto& other = piece[chunk];
+                    if( other.empty() )
+                        continue;
+                    if( subtrie.empty() ) {
+                        subtrie.swap( other );
+                        continue;
+                    }
+                    detail::trie_merger<T> merger;
+                    auto newRoot = merger.merged( subtrie.m_data.m_root, other.m_data.m_root );
+                    subtrie.set_root( newRoot, subtrie.size() + other.size() - merger.duplicates() );
+                    other.clear();
+                }
+            } );
+        }
+        latch.wait();
+
+        size_t bitmap = 0;
+        size_t size = 0;
+        for( size_t chunk = 0; chunk < rootChunks; ++chunk ) {
+            if( !subtries[chunk].empty() ) {
+                bitmap |= size_t(1) << chunk;
+                size += subtries[chunk].size();
+            }
+        }
+        hash_trie trie;
+        if( bitmap == 0 )
+            return trie;
+
+        auto root = branch_node<T>::create_unpopulated( detail::count_set_bits( static_cast<uint32_t>( bitmap ) ), bitmap );
+        size_t compactIndex = 0;
+        for( auto const& subtrie : subtries ) {
+            if( subtrie.empty() )
+                continue;
+            auto subtrieRoot = subtrie.m_data.m_root;
+            assert( subtrieRoot->size() == 1 && !subtrieRoot->is_wide() );
+            root->share_child( compactIndex++, *subtrieRoot, 0 );
+        }
+        trie.set_root( root.release(), size );
+        return trie;
+    }
+
+    namespace detail {
+        // A child slot of a branch, and all the values under it
+        template<typename T>
+        struct trie_slot {
+            branch_node<T> const* branch;
+            size_t compactIndex;
+        };
+
+        // The child slots of a trie, with branches split into their own children, a level at a
+        // time, until there are at least minSlots of them (or nothing left to split). Values are
+        // spread evenly by their hashes, so subtrees at the same level are of much the same size
+        template<typename T>
+        auto split_slots( branch_node<T> const* root, size_t minSlots ) -> std::vector<trie_slot<T>> {
+            std::vector<trie_slot<T>> slots;
+            auto addChildren = [&slots]( branch_node<T> const* branch ) {
+                for( auto i = branch->next_occupied( 0 ); i < branch->capacity(); i = branch->next_occupied( i+1 ) )
+                    slots.push_back( { branch, i } );
+            };
+            addChildren( root );
+
+            bool split = true;
+            while( split && slots.size() < minSlots ) {
+                split = false;
+                auto level = std::move( slots );
+                slots.clear();
+                for( auto const& slot : level ) {
+                    auto compactIndex = compact_index( slot.compactIndex );
+                    if( slot.branch->kind_at( compactIndex ) == child_kind::branch ) {
+                        addChildren( static_cast<branch_node<T> const*>( slot.branch->get_at( compactIndex ) ) );
+                        split = true;
+                    }
+                    else
+                        slots.push_back( slot );
+                }
+            }
+            return slots;
+        }
+
+        // Hands the slots of a trie to executor in groups, calling task( first, last ) for each
+        // group, and waits for them all
+        template<typename T, typename Executor, typename F>
+        void for_each_slot_group( hash_trie<T> const& trie, Executor& executor, F const& task ) {
+            constexpr size_t minSlots = 1024;
+            constexpr size_t maxTasks = 64;
+
+            auto slots = split_slots( trie.data().m_root, minSlots );
+            auto taskCount = std::min( slots.size(), maxTasks );
+            task_latch latch;
+            for( size_t i = 0; i < taskCount; ++i ) {
+                auto first = slots.data() + slots.size() * i / taskCount;
+                auto last = slots.data() + slots.size() * (i+1) / taskCount;
+                latch.execute( executor, [first, last, &task] { task( first, last ); } );
+            }
+            latch.wait();
+        }
+    }
+
+    // Algorithms over all the values of a trie, spread across the tasks of an executor (e.g. a
+    // thread_pool_executor). A trie is never modified in place, so its nodes can be read from any
+    // number of threads at once - but the trie itself must outlive the call.
+    // As with the std algorithms, values are visited in no particular order, and the functions
+    // passed in may be called from several threads at once
+    namespace parallel {
+
+        template<typename T, typename Executor, typename F>
+        void for_each( hash_trie<T> const& trie, Executor& executor, F const& f ) {
+            detail::for_each_slot_group( trie, executor, [&f]( detail::trie_slot<T> const* first, detail::trie_slot<T> const* last ) {
+                for( auto slot = first; slot != last; ++slot )
+                    detail::for_each_value_at( slot->branch, compact_index( slot->compactIndex ), f );
+            } );
+        }
+
+        // reduce must be associative and commutative, as values are combined in no particular order
+        template<typename T, typename Executor, typename R, typename Reduce, typename Transform>
+        auto transform_reduce( hash_trie<T> const& trie, Executor& executor, R init, Reduce const& reduce, Transform const& transform ) -> R {
+            std::mutex mutex;
+            std::vector<R> partials;
+            detail::for_each_slot_group( trie, executor, [&]( detail::trie_slot<T> const* first, detail::trie_slot<T> const* last ) {
+                std::optional<R> partial;
+                for( auto slot = first; slot != last; ++slot ) {
+                    detail::for_each_value_at( slot->branch, compact_index( slot->compactIndex ), [&]( T const& value ) {
+                        if( partial )
+                            partial = reduce( std::move( *partial ), transform( value ) );
+                        else
+                            partial = transform( value );
+                    } );
+                }
+                if( partial ) {
+                    std::lock_guard<std::mutex> lock( mutex );
+                    partials.push_back( std::move( *partial ) );
+                }
+            } );
+            for( auto& partial : partials )
+                init = reduce( std::move( init ), std::move( partial ) );
+            return init;
+        }
+
+        template<typename T, typename Executor, typename Predicate>
+        auto count_if( hash_trie<T> const& trie, Executor& executor, Predicate const& predicate ) -> size_t {
+            return transform_reduce( trie, executor, size_t(0), std::plus<size_t>(),
+                                     [&predicate]( T const& value ) -> size_t { return predicate( value ) ? 1 : 0; } );
+        }
+    }
+
+    namespace detail {
+        // The outcome of one update submitted to an async_committer
+        template<typename R>
+        struct async_update {
+            std::optional<std::conditional_t<std::is_void_v<R>, bool, R>> result;
+            std::exception_ptr error;
+            std::function<void( async_update& )> complete; // called once the update has been committed (or failed)
+
+            auto take() -> R {
+                if( error )
+                    std::rethrow_exception( error );
+                if constexpr( !std::is_void_v<R> )
+                    return std::move( *result );
+            }
+        };
+    }
+
+    // Commits updates to a shared_hash_trie off the calling thread, so an asynchronous caller
+    // needn't block while a commit retries. Updates are queued, and whenever the executor gets
+    // round to them, all those pending are applied to one copy of the trie and committed together
+    // (as with hash_trie_combiner, but the callers don't wait for it). Each update is a function of
+    // hash_trie<T>&, whose result is handed back once the commit has succeeded. If one throws, its
+    // changes are discarded and the exception handed back instead, without affecting the others.
+    // The executor must outlive the committer, which waits for any updates still pending when destroyed
+    template<typename T, typename Executor, typename Reclamation = hazard_pointer_reclamation>
+    class async_committer {
+        struct pending {
+            std::function<void( hash_trie<T>& )> run; // applies the update, recording its outcome
+            std::function<void()> complete;
+        };
+
+        shared_hash_trie<T, Reclamation>& m_shared;
+        Executor& m_executor;
+        std::mutex m_mutex;
+        std::vector<pending> m_pending;
+        bool m_draining = false; // whether a drain() has been handed to the executor
+        std::condition_variable m_drained; // (notified when m_draining goes back to false)
+
+        void submit( pending update ) {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                m_pending.push_back( std::move( update ) );
+                if( std::exchange( m_draining, true ) )
+                    return;
+            }
+            m_executor.execute( [this] { drain(); } );
+        }
+
+        void drain() {
+            // However it finishes (even if committing, or completing, throws), a later submit() can
+            // start another drain, and the destructor can go ahead. Nothing is touched after this
+            // (the notify is under the lock, so the destructor can't have returned before it)
+            struct drain_guard {
+                async_committer& committer;
+                ~drain_guard() {
+                    std::lock_guard<std::mutex> lock( committer.m_mutex );
+                    committer.m_draining = false;
+                    committer.m_drained.notify_all();
+                }
+            } guard { *this };
+
+            std::vector<pending> batch;
+            while( true ) {
+                {
+                    std::lock_guard<std::mutex> lock( m_mutex );
+                    if( m_pending.empty() )
+                        return;
+                    batch.swap( m_pending );
+                }
+                commit( batch );
+                for( auto& update : batch )
+                    update.complete();
+                batch.clear();
+            }
+        }
+
+        void commit( std::vector<pending> const& batch ) {
+            auto transaction = m_shared.start_transaction();
+            while( true ) {
+                auto updated = transaction.get();
+                for( auto const& update : batch )
+                    update.run( updated );
+                if( updated.data().m_root == transaction.get().data().m_root || transaction.try_commit( updated ) )
+                    return;
+            }
+        }
+
+    public:
+        // A pending update. It is only submitted once it is co_awaited (where coroutines are
+        // supported), or get_future() is called. An awaiting coroutine is resumed on the
+        // executor's thread - so an executor for an event loop should post tasks to the loop
+        template<typename R>
+        class [[nodiscard]] operation {
+            async_committer& m_committer;
+            std::function<R( hash_trie<T>& )> m_update;
+            std::shared_ptr<detail::async_update<R>> m_outcome;
+
+            template<typename F>
+            void submit( F&& onComplete ) {
+                assert( !m_outcome );
+                m_outcome = std::make_shared<detail::async_update<R>>();
+                m_outcome->complete = std::forward<F>( onComplete );
+                auto run = [outcome = m_outcome, update = m_update]( hash_trie<T>& trie ) {
+                    // (each attempt starts again, so only the one committed is reported)
+                    outcome->result.reset();
+                    outcome->error = nullptr;
+                    auto before = trie;
+                    try {
+                        if constexpr( std::is_void_v<R> ) {
+                            update( trie );
+                            outcome->result.emplace( true );
+                        }
+                        else
+                            outcome->result.emplace( update( trie ) );
+                    }
+                    catch( ... ) {
+                        outcome->error = std::current_exception();
+                        trie = std::move( before );
+                    }
+                };
+                // (nothing may be touched after this, as a coroutine may already have been resumed)
+                m_committer.submit( { std::move( run ), [outcome = m_outcome] { outcome->complete( *outcome ); } } );
+            }
+
+        public:
+            operation( async_committer& committer, std::function<R( hash_trie<T>& )> update )
+            :   m_committer( committer ),
+                m_update( std::move( update ) )
+            {}
+            operation( operation const& ) = delete;
+            operation& operator = ( operation const& ) = delete;
+
+            auto get_future() -> std::future<R> {
+                auto promise = std::make_shared<std::promise<R>>();
+                auto future = promise->get_future();
+                submit( [promise]( detail::async_update<R>& outcome ) {
+                    try {
+                        if constexpr( std::is_void_v<R> ) {
+                            outcome.take();
+                            promise->set_value();
+                        }
+                        else
+                            promise->set_value( outcome.take() );
+                    }
+                    catch( ... ) {
+                        promise->set_exception( std::current_exception() );
+                    }
+                } );
+                return future;
+            }
+
+#ifdef HAMT_HAS_COROUTINES
+            auto await_ready() const noexcept -> bool { return false; }
+            void await_suspend( std::coroutine_handle<> caller ) {
+                submit( [caller]( detail::async_update<R>& ) { caller.resume(); } );
+            }
+            auto await_resume() -> R { return m_outcome->take(); }
+#endif
+        };
+
+        async_committer( shared_hash_trie<T, Reclamation>& shared, Executor& executor )
+        :   m_shared( shared ),
+            m_executor( executor )
+        {}
+        async_committer( async_committer const& ) = delete;
+        async_committer& operator = ( async_committer const& ) = delete;
+
+        // Waits for any drain() handed to the executor to finish - which may still be running just
+        // after the last update has completed
+        ~async_committer() {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            m_drained.wait( lock, [this] { return !m_draining; } );
+        }
+
+        // Queues update (a function of hash_trie<T>&) to be committed
+        template<typename L>
+        auto commit_async( L update ) -> operation<std::invoke_result_t<L&, hash_trie<T>&>> {
+            return { *this, std::move( update ) };
+        }
+    };
+
+    // A consistent set of snapshots of the shards of a sharded_shared_hash_trie
+    template<typename T, size_t N>
+    class sharded_snapshot {
+        std::array<hash_trie<T>, N> m_shards;
+
+    public:
+        explicit sharded_snapshot( std::array<hash_trie<T>, N>&& shards ) : m_shards( std::move( shards ) ) {}
+
+        auto shard( size_t index ) const -> hash_trie<T> const& { return m_shards[index]; }
+
+        auto size() const -> size_t {
+            size_t size = 0;
+            for( auto const& shard : m_shards )
+                size += shard.size();
+            return size;
+        }
+        auto empty() const -> bool { return size() == 0; }
+
+        auto contains( typename detail::lookup_key<T>::type const& value ) const -> bool {
+            return m_shards[detail::shard_index( detail::hash_of( value ), detail::bits_for( N ) )].contains( value );
+        }
+
+        template<typename F>
+        void for_each( F const& f ) const {
+            for( auto const& shard : m_shards ) {
+                hash_trie_view<T> view( shard );
+                for( auto it = view.begin(); it != view.end(); ++it )
+                    f( *it );
+            }
+        }
+    };
+
+    // N independent shared_hash_tries, each holding the values whose hashes select it, so
+    // writers to different shards never conflict. A simpler alternative to concurrent_hash_trie,
+    // at the cost of snapshots that have to retry while writers are active
+    template<typename T, size_t N, typename Reclamation = hazard_pointer_reclamation>
+    class sharded_shared_hash_trie {
+        static_assert( N > 0 && ( N & (N-1) ) == 0, "the number of shards must be a power of two" );
+
+        struct alignas(64) padded_shard { // (so writers to neighbouring shards don't share a cache line)
+            shared_hash_trie<T, Reclamation> trie;
+        };
+        padded_shard m_shards[N];
+
+    public:
+        static constexpr size_t shards = N;
+
+        static auto shard_of( typename detail::lookup_key<T>::type const& value ) -> size_t {
+            return detail::shard_index( detail::hash_of( value ), detail::bits_for( N ) );
+        }
+
+        auto shard( size_t index ) -> shared_hash_trie<T, Reclamation>& { return m_shards[index].trie; }
+        auto shard( size_t index ) const -> shared_hash_trie<T, Reclamation> const& { return m_shards[index].trie; }
+
+        // Runs updateTask against a transaction on the shard (which should only be given values
+        // that belong to it - see shard_of)
+        template<typename L>
+        void update_shard_with( size_t index, L const& updateTask ) {
+            shard( index ).update_with( updateTask );
+        }
+
+        template<typename U>
+        void insert( U&& value ) {
+            auto index = shard_of( value );
+            update_shard_with( index, [&]( hash_trie<T>& trie ) { trie.insert( value ); } );
+        }
+        void erase( T const& value ) {
+            update_shard_with( shard_of( value ), [&]( hash_trie<T>& trie ) { trie.erase( value ); } );
+        }
+
+        auto contains( typename detail::lookup_key<T>::type const& value ) const -> bool {
+            return shard( shard_of( value ) ).read( [&]( hash_trie_view<T> view ) {
+                return view.contains( value );
+            } );
+        }
+
+        // Each shard is read at a different moment, so while other threads are writing this is
+        // only approximate. For an exact figure, ask a snapshot
+        auto size() const -> size_t {
+            size_t size = 0;
+            for( auto const& shard : m_shards )
+                size += shard.trie.read( []( hash_trie_view<T> view ) { return view.size(); } );
+            return size;
+        }
+
+        // Snapshots every shard as of a single moment: the shards' versions (and roots) are
+        // collected either side of taking the snapshots, and if nothing changed in between then
+        // every snapshot was still current between taking the last of them and the second collect.
+        // Otherwise it tries again
+        auto snapshot() const -> sharded_snapshot<T, N> {
+            std::array<uint64_t, N> versions;
+            std::array<hash_trie<T>, N> snapshots;
+            while( true ) {
+                for( size_t i = 0; i < N; ++i )
+                    versions[i] = shard( i ).version();
+                for( size_t i = 0; i < N; ++i )
+                    snapshots[i] = shard( i ).get();
+
+                // (the version is only bumped after the root is replaced, so the roots are checked too -
+                // and as the snapshots hold them, they can't have been reused)
+                bool unchanged = true;
+                for( size_t i = 0; i < N && unchanged; ++i ) {
+                    unchanged = shard( i ).version() == versions[i] &&
+                                shard( i ).data().m_root == snapshots[i].data().m_root;
+                }
+                if( unchanged )
+                    return sharded_snapshot<T, N>( std::move( snapshots ) );
+            }
+        }
+    };
+
+    // The roots of the tries in a shared_trie_group, which are only ever replaced together
+    template<typename... Ts>
+    class trie_group_root : public node {
+    public:
+        std::tuple<hash_trie<Ts>...> const tries;
+
+        explicit trie_group_root( std::tuple<hash_trie<Ts>...> const& tries )
+        :   node( node_type::group ),
+            tries( tries )
+        {}
+    };
+
+    namespace detail {
+        template<typename... Ts>
+        void release_group_root( void const* p ) {
+            release( static_cast<trie_group_root<Ts...> const*>( p ) );
+        }
+    }
+
+    // Several shared tries that must change together - e.g. a set and its secondary indices.
+    // Rather than each having its own atomic root (so readers could see some changed and not
+    // others), their roots are held in one immutable trie_group_root, which each commit replaces
+    // as a whole. Use shared_trie_group<Ts...> for the default reclamation
+    template<typename Reclamation, typename... Ts>
+    class basic_shared_trie_group {
+        std::atomic<trie_group_root<Ts...> const*> m_root;
+        std::atomic<uint64_t> m_version { 0 }; // incremented after each successful commit
+
+        auto acquire_root() const -> trie_group_root<Ts...> const* {
+            return Reclamation::acquire( m_root );
+        }
+
+    public:
+        using snapshot = std::tuple<hash_trie<Ts>...>;
+
+        class transaction {
+            basic_shared_trie_group& m_group;
+            trie_group_root<Ts...> const* m_base; // (holds a reference)
+            snapshot m_tries; // m_base's tries, to be changed and committed
+
+            auto unchanged() const -> bool {
+                return std::apply( [this]( auto const&... tries ) {
+                    return std::apply( [&]( auto const&... baseTries ) {
+                        return ( ( tries.data().m_root == baseTries.data().m_root ) && ... );
+                    }, m_base->tries );
+                }, m_tries );
+            }
+
+        public:
+            explicit transaction( basic_shared_trie_group& group )
+            :   m_group( group ),
+                m_base( group.acquire_root() ),
+                m_tries( m_base->tries )
+            {}
+            transaction( transaction const& ) = delete;
+            transaction& operator = ( transaction const& ) = delete;
+
+            ~transaction() {
+                release( m_base );
+            }
+
+            template<size_t I>
+            auto get() -> std::tuple_element_t<I, snapshot>& { return std::get<I>( m_tries ); }
+            auto tries() -> snapshot& { return m_tries; }
+
+            // Commits all the tries at once. If another commit got in first, returns false, with
+            // the transaction rebased onto it (so any changes are lost)
+            auto try_commit() -> bool {
+                if( unchanged() )
+                    return true;
+
+                auto newRoot = new trie_group_root<Ts...>( m_tries );
+                addref( newRoot ); // (one for the group, one for our new base)
+                auto expected = m_base;
+                if( m_group.m_root.compare_exchange_strong( expected, newRoot,
+                                                            std::memory_order_seq_cst,
+                                                            std::memory_order_acquire ) ) {
+                    m_group.m_version.fetch_add( 1, std::memory_order_release );
+                    Reclamation::retire( m_base, &detail::release_group_root<Ts...> );
+                    release( std::exchange( m_base, newRoot ) );
+                    return true;
+                }
+                release( newRoot );
+                release( newRoot );
+                release( m_base );
+                m_base = m_group.acquire_root();
+                m_tries = m_base->tries;
+                return false;
+            }
+        };
+
+        basic_shared_trie_group() : m_root( new trie_group_root<Ts...>( snapshot() ) ) {}
+        explicit basic_shared_trie_group( hash_trie<Ts> const&... tries )
+        :   m_root( new trie_group_root<Ts...>( snapshot( tries... ) ) )
+        {}
+
+        basic_shared_trie_group( basic_shared_trie_group const& ) = delete;
+        basic_shared_trie_group& operator = ( basic_shared_trie_group const& ) = delete;
+
+        ~basic_shared_trie_group() {
+            release( m_root.load( std::memory_order_acquire ) );
+        }
+
+        // Snapshots of all the tries, as of the same commit
+        auto get_all() const -> snapshot {
+            auto root = acquire_root();
+            snapshot tries( root->tries );
+            release( root );
+            return tries;
+        }
+
+        template<size_t I>
+        auto get() const -> std::tuple_element_t<I, snapshot> {
+            auto root = acquire_root();
+            auto trie = std::get<I>( root->tries );
+            release( root );
+            return trie;
+        }
+
+        auto version() const -> uint64_t {
+            return m_version.load( std::memory_order_acquire );
+        }
+
+        auto start_transaction() -> transaction {
+            return transaction( *this );
+        }
+
+        // Calls updateTask with each of the tries (as hash_trie<Ts>&...) to change, and commits
+        // them - re-running it on the latest tries until the commit succeeds
+        template<typename L>
+        void update_with( L const& updateTask ) {
+            auto trans = start_transaction();
+            do {
+                std::apply( updateTask, trans.tries() );
+            } while( !trans.try_commit() );
+        }
+    };
+
+    template<typename... Ts>
+    using shared_trie_group = basic_shared_trie_group<hazard_pointer_reclamation, Ts...>;
+
+    namespace detail {
+
+        // concurrent_hash_trie is a Ctrie (Prokopec et al, "Concurrent Tries with Efficient
+        // Non-Blocking Snapshots") with a single level of indirection nodes (I-nodes): the root
+        // I-node's main node is a table of I-nodes, one per shard, each of which has a persistent
+        // hash_trie as its main node. Below that, the usual path copying does the rest.
+        // Each I-node belongs to a generation, and a GCAS of its main node only commits if the
+        // root is still in that generation - otherwise it is rolled back. So a snapshot just swaps
+        // in a root of a new generation (an RDCSS, conditional on the old root's main node), and
+        // the table's I-nodes are copied into the new generation the next time one is written.
+        // These objects are shared between snapshots, so are ref counted - and every release is
+        // deferred through the epoch domain, so anything reached inside an epoch_guard stays alive
+        // (and keeps its references) until the guard is gone
+
+        constexpr size_t ctrieShardBits = 8;
+        constexpr size_t ctrieShards = size_t(1) << ctrieShardBits;
+
+        inline auto next_generation() -> uint64_t {
+            static std::atomic<uint64_t> s_generation { 0 };
+            return ++s_generation;
+        }
+
+        enum class ctrie_kind { table, shard, failed };
+
+        template<typename T>
+        struct ctrie_main {
+            ctrie_kind const kind;
+            std::atomic<size_t> refCount { 1 };
+
+            // Set while a GCAS that installed this main node is being committed: to the main node
+            // it replaced or, if the commit failed, to a failed node that wraps that one
+            std::atomic<ctrie_main*> prev { nullptr };
+
+            explicit ctrie_main( ctrie_kind kind, ctrie_main* prev = nullptr ) : kind( kind ), prev( prev ) {}
+        };
+
+        template<typename T>
+        struct ctrie_inode {
+            std::atomic<size_t> refCount { 1 };
+            std::atomic<ctrie_main<T>*> main;
+            uint64_t const generation;
+
+            ctrie_inode( ctrie_main<T>* main, uint64_t generation ) : main( main ), generation( generation ) {}
+        };
+
+        template<typename T>
+        struct ctrie_table : ctrie_main<T> {
+            ctrie_inode<T>* children[ctrieShards];
+
+            ctrie_table() : ctrie_main<T>( ctrie_kind::table ) {}
+        };
+
+        template<typename T>
+        struct ctrie_shard : ctrie_main<T> {
+            hash_trie<T> trie;
+
+            explicit ctrie_shard( hash_trie<T>&& trie ) : ctrie_main<T>( ctrie_kind::shard ), trie( std::move( trie ) ) {}
+        };
+
+        template<typename T>
+        inline void ctrie_destroy( ctrie_main<T>* main );
+        template<typename T>
+        inline void ctrie_destroy( ctrie_inode<T>* inode );
+
+        template<typename NodeT>
+        inline void ctrie_addref( NodeT* p ) {
+            p->refCount.fetch_add( 1, std::memory_order_relaxed );
+        }
+
+        // Drops a reference once no thread can still be reading p without one
+        template<typename NodeT>
+        inline void ctrie_release( NodeT* p ) {
+            epoch_domain::instance().retire( p, []( void const* retired ) {
+                auto p = static_cast<NodeT*>( const_cast<void*>( retired ) ); // NOLINT
+                if( p->refCount.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+                    ctrie_destroy( p );
+            } );
+        }
+
+        template<typename T>
+        inline void ctrie_destroy( ctrie_main<T>* main ) {
+            // A main node is only unlinked once committed, or after it has been rolled back
+            auto prev = main->prev.load( std::memory_order_relaxed );
+            assert( !prev || prev->kind == ctrie_kind::failed );
+            delete prev; // (the main node a failed node wraps was given back to the I-node)
+
+            switch( main->kind ) {
+                case ctrie_kind::table: {
+                    auto table = static_cast<ctrie_table<T>*>( main );
+                    for( auto child : table->children )
+                        ctrie_release( child );
+                    delete table;
+                    break;
+                }
+                case ctrie_kind::shard:
+                    delete static_cast<ctrie_shard<T>*>( main );
+                    break;
+                case ctrie_kind::failed:
+                    assert( false );
+            }
+        }
+
+        template<typename T>
+        inline void ctrie_destroy( ctrie_inode<T>* inode ) {
+            ctrie_release( inode->main.load( std::memory_order_relaxed ) );
+            delete inode;
+        }
+
+    } // namespace detail
+
+    // A set that many threads can update concurrently. Writers to different shards (by hash)
+    // don't contend at all, and snapshot() is O(1) and lock-free.
+    // Unlike shared_hash_trie, there is no single root to commit to - so there is no persistent
+    // hash_trie of the whole set, either. Take a snapshot() to get a stable view of it
+    template<typename T>
+    class concurrent_hash_trie {
+        using inode = detail::ctrie_inode<T>;
+        using main_node = detail::ctrie_main<T>;
+        using table = detail::ctrie_table<T>;
+        using shard = detail::ctrie_shard<T>;
+
+        enum outcome { undecided, committed, aborted };
+
+        // An RDCSS of the root, in progress - which becomes the root (tagged in its low bit) until it completes
+        struct root_descriptor {
+            inode* oldRoot;
+            main_node* expectedMain;
+            inode* newRoot;
+            std::atomic<int> outcome { undecided };
+        };
+
+        mutable std::atomic<uintptr_t> m_root; // (snapshots change the generation, not the contents)
+
+        explicit concurrent_hash_trie( inode* root ) : m_root( reinterpret_cast<uintptr_t>( root ) ) {}
+
+        static auto is_descriptor( uintptr_t root ) -> bool { return ( root & 1 ) != 0; }
+
+        static auto descriptor( uintptr_t root ) -> root_descriptor* {
+            return reinterpret_cast<root_descriptor*>( root & ~uintptr_t(1) ); // NOLINT
+        }
+
+        // Completes (or helps complete) any RDCSS in progress. If abort is true one that is still
+        // undecided is rolled back instead - which a GCAS needs, to know the root's generation
+        auto read_root( bool abort = false ) const -> inode* {
+            while( true ) {
+                auto root = m_root.load();
+                if( !is_descriptor( root ) )
+                    return reinterpret_cast<inode*>( root ); // NOLINT
+
+                auto desc = descriptor( root );
+                int result = desc->outcome.load();
+                if( result == undecided ) {
+                    int decision = !abort && gcas_read( desc->oldRoot ) == desc->expectedMain ? committed : aborted;
+                    if( desc->outcome.compare_exchange_strong( result, decision ) )
+                        result = decision;
+                }
+                auto newRoot = result == committed ? desc->newRoot : desc->oldRoot;
+                if( m_root.compare_exchange_strong( root, reinterpret_cast<uintptr_t>( newRoot ) ) ) {
+                    // The descriptor's reference to the root that lost is dropped
+                    detail::ctrie_release( result == committed ? desc->oldRoot : desc->newRoot );
+                    detail::epoch_domain::instance().retire( desc, []( void const* p ) {
+                        delete static_cast<root_descriptor const*>( p );
+                    } );
+                    return newRoot;
+                }
+            }
+        }
+
+        // Replaces oldRoot with newRoot (taking ownership of it), if oldRoot's main node is
+        // still expectedMain
+        auto rdcss_root( inode* oldRoot, main_node* expectedMain, inode* newRoot ) const -> bool {
+            auto desc = new root_descriptor{ oldRoot, expectedMain, newRoot };
+            auto expected = reinterpret_cast<uintptr_t>( oldRoot );
+            if( !m_root.compare_exchange_strong( expected, reinterpret_cast<uintptr_t>( desc ) | 1 ) ) {
+                delete desc;
+                detail::ctrie_destroy( newRoot );
+                return false;
+            }
+            read_root();
+            return desc->outcome.load() == committed; // (the descriptor is retired, but still alive)
+        }
+
+        // The I-node's committed main node - completing any GCAS in progress first
+        auto gcas_read( inode* in ) const -> main_node* {
+            auto main = in->main.load();
+            if( !main->prev.load() )
+                return main;
+            return gcas_commit( in, main );
+        }
+
+        auto gcas_commit( inode* in, main_node* main ) const -> main_node* {
+            while( true ) {
+                auto prev = main->prev.load();
+                auto root = read_root( true );
+                if( !prev )
+                    return main;
+
+                if( prev->kind == detail::ctrie_kind::failed ) {
+                    // Roll back to the main node that the failed GCAS replaced
+                    auto restored = prev->prev.load();
+                    auto expected = main;
+                    if( in->main.compare_exchange_strong( expected, restored ) ) {
+                        detail::ctrie_release( main );
+                        return restored;
+                    }
+                    main = in->main.load();
+                }
+                else if( root->generation == in->generation ) {
+                    if( main->prev.compare_exchange_strong( prev, nullptr ) ) {
+                        detail::ctrie_release( prev );
+                        return main;
+                    }
+                }
+                else {
+                    // The root has moved on to a new generation (i.e. a snapshot has been taken)
+                    // since this I-node was written to, so the GCAS must fail
+                    auto failed = new main_node( detail::ctrie_kind::failed, prev );
+                    if( !main->prev.compare_exchange_strong( prev, failed ) )
+                        delete failed;
+                    main = in->main.load();
+                }
+            }
+        }
+
+        // Replaces the I-node's main node, from expected to replacement (taking ownership of it),
+        // if it is still expected, and the root is still in the I-node's generation
+        auto gcas( inode* in, main_node* expected, main_node* replacement ) const -> bool {
+            replacement->prev.store( expected );
+            auto current = expected;
+            if( !in->main.compare_exchange_strong( current, replacement ) ) {
+                replacement->prev.store( nullptr );
+                detail::ctrie_destroy( replacement );
+                return false;
+            }
+            gcas_commit( in, replacement );
+            return replacement->prev.load() == nullptr;
+        }
+
+        auto copy_to_generation( inode* in, uint64_t generation ) const -> inode* {
+            auto main = gcas_read( in );
+            detail::ctrie_addref( main );
+            return new inode( main, generation );
+        }
+
+        // Copies the table's I-nodes into the root's generation, so they can be written to.
+        // If this fails, someone else has either done the same or taken a snapshot - and either way
+        // the caller just starts again
+        void renew( inode* root, table* current ) const {
+            auto renewed = new table;
+            for( size_t i = 0; i < detail::ctrieShards; ++i ) {
+                auto child = current->children[i];
+                if( child->generation == root->generation ) {
+                    detail::ctrie_addref( child );
+                    renewed->children[i] = child;
+                }
+                else
+                    renewed->children[i] = copy_to_generation( child, root->generation );
+            }
+            gcas( root, current, renewed );
+        }
+
+        // The I-node for a shard, in the current generation
+        auto shard_inode( size_t index, inode*& root ) -> inode* {
+            while( true ) {
+                root = read_root();
+                auto current = static_cast<table*>( gcas_read( root ) );
+                auto child = current->children[index];
+                if( child->generation == root->generation )
+                    return child;
+                renew( root, current );
+            }
+        }
+
+        // update is given a copy of the shard's hash_trie, and returns whether it changed it
+        template<typename F>
+        auto update_shard( size_t hash, F const& update ) -> bool {
+            detail::epoch_guard guard;
+            auto index = detail::shard_index( hash, detail::ctrieShardBits );
+            while( true ) {
+                inode* root;
+                auto child = shard_inode( index, root );
+                auto current = static_cast<shard*>( gcas_read( child ) );
+                hash_trie<T> updated( current->trie );
+                if( !update( updated ) )
+                    return false;
+                if( gcas( child, current, new shard( std::move( updated ) ) ) )
+                    return true;
+            }
+        }
+
+        template<typename F>
+        void for_each_shard( F const& f ) const {
+            auto root = read_root();
+            auto current = static_cast<table*>( gcas_read( root ) );
+            for( auto child : current->children )
+                f( static_cast<shard*>( gcas_read( child ) )->trie );
+        }
+
+    public:
+        concurrent_hash_trie( concurrent_hash_trie const& ) = delete;
+        concurrent_hash_trie& operator = ( concurrent_hash_trie const& ) = delete;
+        concurrent_hash_trie& operator = ( concurrent_hash_trie&& ) = delete;
+
+        concurrent_hash_trie() {
+            auto generation = detail::next_generation();
+            auto initial = new table;
+            for( auto& child : initial->children )
+                child = new inode( new shard( hash_trie<T>() ), generation );
+            m_root = reinterpret_cast<uintptr_t>( new inode( initial, generation ) );
+        }
+
+        ~concurrent_hash_trie() {
+            auto root = m_root.load();
+            assert( !is_descriptor( root ) );
+            detail::ctrie_release( reinterpret_cast<inode*>( root ) ); // NOLINT
+        }
+
+        // Returns true if the value was inserted (i.e. was not already present)
+        template<typename U>
+        auto insert( U&& value ) -> bool {
+            auto hash = detail::hash_of<T>( value );
+            return update_shard( hash, [&]( hash_trie<T>& trie ) {
+                auto size = trie.size();
+                trie.insert( std::forward<U>( value ) );
+                return trie.size() != size;
+            } );
+        }
+
+        // Returns true if the value was present
+        auto erase( T const& value ) -> bool {
+            return update_shard( detail::hash_of( value ), [&]( hash_trie<T>& trie ) {
+                return trie.erase( value );
+            } );
+        }
+
+        auto contains( typename detail::lookup_key<T>::type const& value ) const -> bool {
+            detail::epoch_guard guard;
+            auto index = detail::shard_index( detail::hash_of( value ), detail::ctrieShardBits );
+            auto root = read_root();
+            auto current = static_cast<table*>( gcas_read( root ) );
+            return static_cast<shard*>( gcas_read( current->children[index] ) )->trie.contains( value );
+        }
+
+        // Each shard is read at a different moment, so while other threads are writing this is
+        // only approximate (and O(shards)). For an exact figure, ask a snapshot
+        auto size() const -> size_t {
+            detail::epoch_guard guard;
+            size_t size = 0;
+            for_each_shard( [&]( hash_trie<T> const& trie ) { size += trie.size(); } );
+            return size;
+        }
+        auto empty() const -> bool { return size() == 0; }
+
+        // Calls f with each value. As with size(), for a consistent view call this on a snapshot
+        template<typename F>
+        void for_each( F const& f ) const {
+            detail::epoch_guard guard;
+            for_each_shard( [&]( hash_trie<T> const& trie ) {
+                hash_trie_view<T> view( trie );
+                for( auto it = view.begin(); it != view.end(); ++it )
+                    f( *it );
+            } );
+        }
+
+        // An independent (and writable) copy, of the contents at a single point in time.
+        // Both tries then share everything, copying shards into their own generation as they are written
+        auto snapshot() const -> concurrent_hash_trie {
+            detail::epoch_guard guard;
+            while( true ) {
+                auto root = read_root();
+                auto expectedMain = gcas_read( root );
+                detail::ctrie_addref( expectedMain );
+                if( rdcss_root( root, expectedMain, new inode( expectedMain, detail::next_generation() ) ) )
+                    return concurrent_hash_trie( copy_to_generation( root, detail::next_generation() ) );
+            }
+        }
+    };
 
 }
 